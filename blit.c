@@ -0,0 +1,214 @@
+/*
+ * Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLIT_X86 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "blit.h"
+
+typedef void (*blit_fill_func_t)(uint32_t* dst, uint32_t rgba, uint32_t count);
+typedef void (*blit_copy_func_t)(uint32_t* dst, const uint32_t* src, uint32_t count);
+
+static void blit_fill32_c(uint32_t* dst, uint32_t rgba, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+		dst[i] = rgba;
+}
+
+static void blit_copy32_c(uint32_t* dst, const uint32_t* src, uint32_t count)
+{
+	memcpy(dst, src, count * sizeof(*dst));
+}
+
+#if defined(BLIT_X86)
+
+/*
+ * Head is done one pixel at a time until |dst| is aligned to the vector
+ * size, so all vector stores are aligned and never split a cache line.
+ */
+__attribute__((target("sse2")))
+static void blit_fill32_sse2(uint32_t* dst, uint32_t rgba, uint32_t count)
+{
+	__m128i v = _mm_set1_epi32(rgba);
+
+	for (; count && ((uintptr_t)dst & 15); count--)
+		*dst++ = rgba;
+	for (; count >= 16; count -= 16, dst += 16) {
+		_mm_store_si128((__m128i*)dst, v);
+		_mm_store_si128((__m128i*)(dst + 4), v);
+		_mm_store_si128((__m128i*)(dst + 8), v);
+		_mm_store_si128((__m128i*)(dst + 12), v);
+	}
+	for (; count >= 4; count -= 4, dst += 4)
+		_mm_store_si128((__m128i*)dst, v);
+	while (count--)
+		*dst++ = rgba;
+}
+
+__attribute__((target("sse2")))
+static void blit_copy32_sse2(uint32_t* dst, const uint32_t* src, uint32_t count)
+{
+	for (; count && ((uintptr_t)dst & 15); count--)
+		*dst++ = *src++;
+	for (; count >= 4; count -= 4, dst += 4, src += 4)
+		_mm_store_si128((__m128i*)dst,
+				_mm_loadu_si128((const __m128i*)src));
+	while (count--)
+		*dst++ = *src++;
+}
+
+__attribute__((target("sse2")))
+static void blit_stream32_sse2(uint32_t* dst, const uint32_t* src, uint32_t count)
+{
+	for (; count && ((uintptr_t)dst & 15); count--)
+		*dst++ = *src++;
+	for (; count >= 4; count -= 4, dst += 4, src += 4)
+		_mm_stream_si128((__m128i*)dst,
+				 _mm_loadu_si128((const __m128i*)src));
+	while (count--)
+		*dst++ = *src++;
+}
+
+__attribute__((target("avx2")))
+static void blit_fill32_avx2(uint32_t* dst, uint32_t rgba, uint32_t count)
+{
+	__m256i v = _mm256_set1_epi32(rgba);
+
+	for (; count && ((uintptr_t)dst & 31); count--)
+		*dst++ = rgba;
+	for (; count >= 32; count -= 32, dst += 32) {
+		_mm256_store_si256((__m256i*)dst, v);
+		_mm256_store_si256((__m256i*)(dst + 8), v);
+		_mm256_store_si256((__m256i*)(dst + 16), v);
+		_mm256_store_si256((__m256i*)(dst + 24), v);
+	}
+	for (; count >= 8; count -= 8, dst += 8)
+		_mm256_store_si256((__m256i*)dst, v);
+	while (count--)
+		*dst++ = rgba;
+}
+
+__attribute__((target("avx2")))
+static void blit_copy32_avx2(uint32_t* dst, const uint32_t* src, uint32_t count)
+{
+	for (; count && ((uintptr_t)dst & 31); count--)
+		*dst++ = *src++;
+	for (; count >= 8; count -= 8, dst += 8, src += 8)
+		_mm256_store_si256((__m256i*)dst,
+				   _mm256_loadu_si256((const __m256i*)src));
+	while (count--)
+		*dst++ = *src++;
+}
+
+__attribute__((target("avx2")))
+static void blit_stream32_avx2(uint32_t* dst, const uint32_t* src, uint32_t count)
+{
+	for (; count && ((uintptr_t)dst & 31); count--)
+		*dst++ = *src++;
+	for (; count >= 8; count -= 8, dst += 8, src += 8)
+		_mm256_stream_si256((__m256i*)dst,
+				    _mm256_loadu_si256((const __m256i*)src));
+	while (count--)
+		*dst++ = *src++;
+}
+
+__attribute__((target("sse2")))
+static void blit_sfence(void)
+{
+	_mm_sfence();
+}
+
+#elif defined(__ARM_NEON)
+
+static void blit_fill32_neon(uint32_t* dst, uint32_t rgba, uint32_t count)
+{
+	uint32x4_t v = vdupq_n_u32(rgba);
+
+	for (; count >= 16; count -= 16, dst += 16) {
+		vst1q_u32(dst, v);
+		vst1q_u32(dst + 4, v);
+		vst1q_u32(dst + 8, v);
+		vst1q_u32(dst + 12, v);
+	}
+	for (; count >= 4; count -= 4, dst += 4)
+		vst1q_u32(dst, v);
+	while (count--)
+		*dst++ = rgba;
+}
+
+/* Also used for streaming, wide stores are enough to fill WC buffers. */
+static void blit_copy32_neon(uint32_t* dst, const uint32_t* src, uint32_t count)
+{
+	for (; count >= 4; count -= 4, dst += 4, src += 4)
+		vst1q_u32(dst, vld1q_u32(src));
+	while (count--)
+		*dst++ = *src++;
+}
+
+#endif
+
+static blit_fill_func_t blit_fill_func;
+static blit_copy_func_t blit_copy_func;
+static blit_copy_func_t blit_stream_func;
+
+/* Pick kernels for this CPU. */
+void blit_select(void)
+{
+	blit_fill_func_t fill = blit_fill32_c;
+	blit_copy_func_t copy = blit_copy32_c;
+	blit_copy_func_t stream = blit_copy32_c;
+
+#if defined(BLIT_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		fill = blit_fill32_avx2;
+		copy = blit_copy32_avx2;
+		stream = blit_stream32_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		fill = blit_fill32_sse2;
+		copy = blit_copy32_sse2;
+		stream = blit_stream32_sse2;
+	}
+#elif defined(__ARM_NEON)
+	fill = blit_fill32_neon;
+	copy = blit_copy32_neon;
+	stream = blit_copy32_neon;
+#endif
+
+	blit_fill_func = fill;
+	blit_copy_func = copy;
+	blit_stream_func = stream;
+}
+
+void blit_fill32(uint32_t* dst, uint32_t rgba, uint32_t count)
+{
+	blit_fill_func(dst, rgba, count);
+}
+
+void blit_copy32(uint32_t* dst, const uint32_t* src, uint32_t count)
+{
+	blit_copy_func(dst, src, count);
+}
+
+void blit_stream32(uint32_t* dst, const uint32_t* src, uint32_t count)
+{
+	blit_stream_func(dst, src, count);
+}
+
+void blit_stream_done(void)
+{
+#if defined(BLIT_X86)
+	if (blit_stream_func != blit_copy32_c)
+		blit_sfence();
+#endif
+}
@@ -0,0 +1,28 @@
+/*
+ * Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef BLIT_H
+#define BLIT_H
+
+#include <stdint.h>
+
+/*
+ * 32 bit pixel row kernels. The implementation (AVX2, SSE2, NEON or plain C)
+ * is picked by blit_select() based on what the CPU supports. It has to be
+ * called once at startup, before any kernel is used or threads are created.
+ */
+void blit_select(void);
+void blit_fill32(uint32_t* dst, uint32_t rgba, uint32_t count);
+void blit_copy32(uint32_t* dst, const uint32_t* src, uint32_t count);
+
+/*
+ * Copy into write-combined memory bypassing the cache. Call blit_stream_done()
+ * after the last blit_stream32() to make the stores globally visible.
+ */
+void blit_stream32(uint32_t* dst, const uint32_t* src, uint32_t count);
+void blit_stream_done(void);
+
+#endif
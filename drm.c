@@ -6,6 +6,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -48,6 +49,29 @@ static int32_t atomic_set_prop(drm_t* drm, drmModeAtomicReqPtr pset, uint32_t id
 	return -ENOENT;
 }
 
+static uint32_t get_prop_id(drm_t* drm, uint32_t obj_id, uint32_t obj_type,
+			    const char *name)
+{
+	drmModeObjectPropertiesPtr props;
+	uint32_t prop_id = 0;
+
+	props = drmModeObjectGetProperties(drm->fd, obj_id, obj_type);
+	if (!props)
+		return 0;
+
+	for (uint32_t u = 0; u < props->count_props && !prop_id; u++) {
+		drmModePropertyPtr prop = drmModeGetProperty(drm->fd, props->props[u]);
+		if (!prop)
+			continue;
+		if (strcmp(prop->name, name) == 0)
+			prop_id = prop->prop_id;
+		drmModeFreeProperty(prop);
+	}
+
+	drmModeFreeObjectProperties(props);
+	return prop_id;
+}
+
 static int32_t crtc_planes_num(drm_t* drm, int32_t crtc_index)
 {
 	drmModePlanePtr plane;
@@ -562,8 +586,11 @@ int drm_dropmaster(drm_t* drm)
 
 	if (!drm)
 		drm = g_drm;
-	if (drm)
+	if (drm) {
 		ret = drmDropMaster(drm->fd);
+		/* Whoever becomes master next will scan out its own buffers. */
+		drm->console_fb_id = 0;
+	}
 	return ret;
 }
 
@@ -636,6 +663,7 @@ static int32_t drm_setmode_atomic(drm_t* drm, uint32_t fb_id)
 	drmModePlaneResPtr plane_resources;
 	drmModeAtomicReqPtr pset = NULL;
 	uint32_t mode_id = 0, ctm_id = 0;
+	uint32_t console_plane_id = 0;
 
 	plane_resources = drmModeGetPlaneResources(drm->fd);
 	if (!plane_resources)
@@ -724,6 +752,7 @@ static int32_t drm_setmode_atomic(drm_t* drm, uint32_t fb_id)
 		}
 
 		if (is_crtc_possible(drm, console_crtc_id, possible_crtcs) && primary) {
+			console_plane_id = plane_id;
 			CHECK(atomic_set_prop(drm, pset, plane_id, plane_props, "FB_ID", fb_id));
 			CHECK(atomic_set_prop(drm, pset, plane_id, plane_props, "CRTC_ID", console_crtc_id));
 			CHECK(atomic_set_prop(drm, pset, plane_id, plane_props, "CRTC_X", 0));
@@ -769,6 +798,14 @@ static int32_t drm_setmode_atomic(drm_t* drm, uint32_t fb_id)
 		/* LOG(INFO, "TIMING: Console switch atomic modeset finished."); */
 	} else {
 		ret = 0;
+		drm->console_crtc_id = console_crtc_id;
+		drm->console_plane_id = console_plane_id;
+		drm->console_fb_id = fb_id;
+		drm->plane_fb_id_prop = get_prop_id(drm, console_plane_id,
+						    DRM_MODE_OBJECT_PLANE, "FB_ID");
+		drm->plane_damage_clips_prop = get_prop_id(drm, console_plane_id,
+							   DRM_MODE_OBJECT_PLANE,
+							   "FB_DAMAGE_CLIPS");
 	}
 
 error_mode:
@@ -873,6 +910,10 @@ int32_t drm_setmode(drm_t* drm, uint32_t fb_id)
 				return ret;
 			}
 
+			drm->console_crtc_id = console_crtc_id;
+			drm->console_plane_id = 0;
+			drm->console_fb_id = fb_id;
+
 			ret = drmModeSetCursor(drm->fd, console_crtc_id,
 						0, 0, 0);
 
@@ -923,6 +964,233 @@ void drm_rmfb(drm_t* drm, uint32_t fb_id)
 	drm->delayed_rmfb_fb_id = fb_id;
 }
 
+/*
+ * Point the console plane at |fb_id|, passing damaged rectangles through the
+ * FB_DAMAGE_CLIPS plane property when it is supported.
+ */
+static int32_t drm_atomic_commit_fb(drm_t* drm, uint32_t fb_id,
+				    const struct drm_mode_rect* rects,
+				    uint32_t count, uint32_t flags)
+{
+	drmModeAtomicReqPtr pset;
+	uint32_t blob_id = 0;
+	int32_t ret;
+
+	if (drm->plane_damage_clips_prop && count) {
+		ret = drmModeCreatePropertyBlob(drm->fd, rects,
+						count * sizeof(*rects), &blob_id);
+		if (ret)
+			return ret;
+	}
+
+	pset = drmModeAtomicAlloc();
+	if (!pset) {
+		ret = -ENOMEM;
+		goto destroy_blob;
+	}
+
+	if (drmModeAtomicAddProperty(pset, drm->console_plane_id,
+				     drm->plane_fb_id_prop, fb_id) < 0 ||
+	    (blob_id &&
+	     drmModeAtomicAddProperty(pset, drm->console_plane_id,
+				      drm->plane_damage_clips_prop, blob_id) < 0)) {
+		ret = -ENOMEM;
+		goto free_pset;
+	}
+
+	ret = drmModeAtomicCommit(drm->fd, pset, flags, drm);
+
+free_pset:
+	drmModeAtomicFree(pset);
+destroy_blob:
+	/* The commit holds its own reference to the blob. */
+	if (blob_id)
+		drmModeDestroyPropertyBlob(drm->fd, blob_id);
+	return ret;
+}
+
+/* Commit damage without blocking, completion is handled like a flip. */
+static int32_t drm_atomic_damage_commit(drm_t* drm, uint32_t fb_id,
+					const struct drm_mode_rect* rects,
+					uint32_t count)
+{
+	int32_t ret;
+
+	ret = drm_atomic_commit_fb(drm, fb_id, rects, count,
+				   DRM_MODE_ATOMIC_NONBLOCK |
+				   DRM_MODE_PAGE_FLIP_EVENT);
+	if (ret)
+		return ret;
+
+	drm->flip_pending = true;
+	drm->flip_time_us = get_monotonic_time_us();
+	return 0;
+}
+
+/* Commit the damage held back while the last commit was pending. */
+static void drm_flush_deferred_damage(drm_t* drm)
+{
+	uint32_t fb_id = drm->deferred_damage_fb_id;
+
+	drm->deferred_damage_fb_id = 0;
+	if (!fb_id || fb_id != drm->console_fb_id)
+		return;
+
+	if (drm_atomic_damage_commit(drm, fb_id, &drm->deferred_damage, 1))
+		LOG(WARNING, "Failed to commit deferred damage.");
+}
+
+/*
+ * Report damaged rectangles of the framebuffer scanned out on the console
+ * plane through the FB_DAMAGE_CLIPS plane property. Fails if |fb_id| is not
+ * being scanned out or damage clips are not supported, callers are expected
+ * to fall back to drmModeDirtyFB(). While a commit or flip is still pending
+ * the damage is merged into one rectangle and committed once it completes.
+ */
+int32_t drm_atomic_damage(drm_t* drm, uint32_t fb_id,
+			  const struct drm_mode_rect* rects, uint32_t count)
+{
+	struct drm_mode_rect* d = &drm->deferred_damage;
+	uint32_t i = 0;
+
+	if (!drm->atomic || !drm->console_plane_id || drm->console_fb_id != fb_id)
+		return -ENOENT;
+
+	if (!drm->plane_fb_id_prop || !drm->plane_damage_clips_prop)
+		return -ENOTSUP;
+
+	if (!count || !drm_flip_pending(drm))
+		return drm_atomic_damage_commit(drm, fb_id, rects, count);
+
+	if (drm->deferred_damage_fb_id != fb_id) {
+		drm->deferred_damage_fb_id = fb_id;
+		*d = rects[i++];
+	}
+	for (; i < count; i++) {
+		d->x1 = MIN(d->x1, rects[i].x1);
+		d->y1 = MIN(d->y1, rects[i].y1);
+		d->x2 = MAX(d->x2, rects[i].x2);
+		d->y2 = MAX(d->y2, rects[i].y2);
+	}
+	return 0;
+}
+
+/*
+ * Queue flip of the console crtc to |fb_id|. Only one flip can be in flight,
+ * completion is picked up by drm_dispatch_io(), drm_flip_pending() or
+ * drm_wait_flip(). Returns -EBUSY rather than waiting while the last flip
+ * is still pending.
+ */
+int32_t drm_page_flip(drm_t* drm, uint32_t fb_id,
+		      const struct drm_mode_rect* rects, uint32_t count)
+{
+	int32_t ret;
+
+	if (!drm->console_fb_id || !drm->console_crtc_id)
+		return -ENOENT;
+
+	if (drm_flip_pending(drm))
+		return -EBUSY;
+
+	if (drm->atomic && drm->console_plane_id && drm->plane_fb_id_prop)
+		ret = drm_atomic_commit_fb(drm, fb_id, rects, count,
+					   DRM_MODE_ATOMIC_NONBLOCK |
+					   DRM_MODE_PAGE_FLIP_EVENT);
+	else
+		ret = drmModePageFlip(drm->fd, drm->console_crtc_id, fb_id,
+				      DRM_MODE_PAGE_FLIP_EVENT, drm);
+	if (ret)
+		return ret;
+
+	drm->flip_pending = true;
+	drm->flip_time_us = get_monotonic_time_us();
+	drm->console_fb_id = fb_id;
+	return 0;
+}
+
+static void drm_page_flip_handler(int fd, unsigned int frame,
+				  unsigned int sec, unsigned int usec,
+				  void* data)
+{
+	drm_t* drm = (drm_t*)data;
+
+	drm->flip_pending = false;
+	drm_flush_deferred_damage(drm);
+}
+
+static void drm_handle_event(drm_t* drm)
+{
+	drmEventContext evctx;
+
+	memset(&evctx, 0, sizeof(evctx));
+	evctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evctx.page_flip_handler = drm_page_flip_handler;
+	drmHandleEvent(drm->fd, &evctx);
+}
+
+#define DRM_FLIP_TIMEOUT_MS 1000
+
+/*
+ * Wait up to |timeout_ms| for the pending flip. With 0 only pick it up if
+ * done, or give up on it once it is overdue same as waiting would.
+ */
+static void drm_wait_flip_timeout(drm_t* drm, int timeout_ms)
+{
+	struct pollfd pfd;
+	int ret;
+
+	pfd.fd = drm->fd;
+	pfd.events = POLLIN;
+	while (drm->flip_pending) {
+		ret = poll(&pfd, 1, timeout_ms);
+		if (ret == 0 && !timeout_ms &&
+		    get_monotonic_time_us() - drm->flip_time_us <
+		    DRM_FLIP_TIMEOUT_MS * 1000)
+			break;
+		if (ret <= 0) {
+			LOG(WARNING, "Timed out waiting for page flip.");
+			drm->flip_pending = false;
+			break;
+		}
+		drm_handle_event(drm);
+	}
+}
+
+void drm_wait_flip(drm_t* drm)
+{
+	if (!drm)
+		return;
+
+	drm_wait_flip_timeout(drm, DRM_FLIP_TIMEOUT_MS);
+}
+
+bool drm_flip_pending(drm_t* drm)
+{
+	if (!drm)
+		return false;
+
+	drm_wait_flip_timeout(drm, 0);
+	return drm->flip_pending;
+}
+
+void drm_add_fds(fd_set* read_set, fd_set* exception_set, int *maxfd)
+{
+	if (!g_drm || !g_drm->flip_pending)
+		return;
+
+	FD_SET(g_drm->fd, read_set);
+	*maxfd = MAX(*maxfd, g_drm->fd);
+}
+
+void drm_dispatch_io(fd_set* read_set, fd_set* exception_set)
+{
+	if (!g_drm || !g_drm->flip_pending)
+		return;
+
+	if (FD_ISSET(g_drm->fd, read_set))
+		drm_handle_event(g_drm);
+}
+
 bool drm_read_edid(drm_t* drm)
 {
 	drmModeConnector* console_connector;
@@ -966,3 +1234,8 @@ uint32_t drm_getvres(drm_t* drm)
 {
 	return drm->console_mode_info.vdisplay;
 }
+
+uint32_t drm_getvrefresh(drm_t* drm)
+{
+	return drm->console_mode_info.vrefresh;
+}
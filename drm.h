@@ -10,6 +10,7 @@
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <sys/select.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
@@ -55,6 +56,17 @@ typedef struct _drm_t {
 	uint32_t delayed_rmfb_fb_id;
 	bool atomic;
 	int32_t panel_orientation; // DRM_PANEL_ORIENTATION_*
+	uint32_t console_crtc_id; // set by the last successful modeset
+	uint32_t console_plane_id; // atomic only
+	uint32_t console_fb_id; // fb currently scanned out by us, 0 if none
+	uint32_t plane_fb_id_prop;
+	uint32_t plane_damage_clips_prop; // 0 if FB_DAMAGE_CLIPS is not supported
+	bool flip_pending;
+	int64_t flip_time_us; // when the pending flip was queued
+	struct drm_mode_rect deferred_damage; // bounds of damage held back
+	uint32_t deferred_damage_fb_id; // fb of |deferred_damage|, 0 if none
+	bool dirty_fb_needed; // DirtyFB worked, scanout has to be flushed
+	bool dirty_fb_nosys; // DirtyFB returned ENOSYS, nothing to flush
 } drm_t;
 
 drm_t* drm_scan(void);
@@ -68,8 +80,18 @@ bool drm_rescan(void);
 bool drm_valid(drm_t* drm);
 int32_t drm_setmode(drm_t* drm, uint32_t fb_id);
 void drm_rmfb(drm_t* drm, uint32_t fb_id);
+int32_t drm_atomic_damage(drm_t* drm, uint32_t fb_id,
+			  const struct drm_mode_rect* rects, uint32_t count);
+int32_t drm_page_flip(drm_t* drm, uint32_t fb_id,
+		      const struct drm_mode_rect* rects, uint32_t count);
+void drm_wait_flip(drm_t* drm);
+/* Whether a flip is still in flight, does not block. */
+bool drm_flip_pending(drm_t* drm);
+void drm_add_fds(fd_set* read_set, fd_set* exception_set, int *maxfd);
+void drm_dispatch_io(fd_set* read_set, fd_set* exception_set);
 bool drm_read_edid(drm_t* drm);
 uint32_t drm_gethres(drm_t* drm);
 uint32_t drm_getvres(drm_t* drm);
+uint32_t drm_getvrefresh(drm_t* drm);
 
 #endif
@@ -13,18 +13,354 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "blit.h"
 #include "util.h"
 #include "fb.h"
+#include "main.h"
 
-static int fb_buffer_create(fb_t* fb,
-			    int* pitch)
+#define FB_STATS_INTERVAL_MS (5 * MS_PER_SEC)
+/* Statistics are only logged at debug level, skip sampling them otherwise. */
+#define FB_STATS_ENABLED (DEBUG <= LOG_LEVEL)
+
+/*
+ * Mapping statistics, shared by all framebuffers. The mapping is created once
+ * per dumb buffer so |maps| should only move on buffer (re)creation, and
+ * |faults| counts page faults taken while framebuffers are locked.
+ */
+static struct {
+	uint64_t maps;
+	uint64_t faults;
+	int64_t last_report_ms;
+} fb_stats;
+
+static long fb_get_faults(void)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage))
+		return 0;
+	return usage.ru_minflt + usage.ru_majflt;
+}
+
+static void fb_report_stats(void)
+{
+	int64_t now_ms = get_monotonic_time_ms();
+	int64_t elapsed_ms = now_ms - fb_stats.last_report_ms;
+
+	if (elapsed_ms < FB_STATS_INTERVAL_MS)
+		return;
+
+	if (fb_stats.last_report_ms)
+		LOG(DEBUG, "fb: %.1f maps/s, %.1f faults/s",
+		    fb_stats.maps * (double)MS_PER_SEC / elapsed_ms,
+		    fb_stats.faults * (double)MS_PER_SEC / elapsed_ms);
+
+	fb_stats.maps = 0;
+	fb_stats.faults = 0;
+	fb_stats.last_report_ms = now_ms;
+}
+
+static int64_t fb_rect_area(const struct drm_mode_rect* r)
+{
+	return (int64_t)(r->x2 - r->x1) * (r->y2 - r->y1);
+}
+
+static void fb_rect_union(struct drm_mode_rect* r, const struct drm_mode_rect* o)
+{
+	r->x1 = MIN(r->x1, o->x1);
+	r->y1 = MIN(r->y1, o->y1);
+	r->x2 = MAX(r->x2, o->x2);
+	r->y2 = MAX(r->y2, o->y2);
+}
+
+/*
+ * Add rectangle to damage. Rectangles which overlap or touch existing ones
+ * are merged with them, so neighbouring cells collapse into row spans and
+ * blocks. Once the list is full the rectangle is merged with the entry whose
+ * area grows the least.
+ */
+static void fb_damage_add(fb_damage_t* damage, struct drm_mode_rect r)
+{
+	struct drm_mode_rect u;
+	int64_t cost, best_cost;
+	uint32_t i, best;
+
+restart:
+	for (i = 0; i < damage->count; i++) {
+		struct drm_mode_rect* d = &damage->rects[i];
+
+		if (r.x1 >= d->x1 && r.y1 >= d->y1 && r.x2 <= d->x2 && r.y2 <= d->y2)
+			return;
+
+		if (r.x1 <= d->x2 && d->x1 <= r.x2 && r.y1 <= d->y2 && d->y1 <= r.y2) {
+			fb_rect_union(&r, d);
+			*d = damage->rects[--damage->count];
+			goto restart;
+		}
+	}
+
+	if (damage->count < FB_MAX_DAMAGE_RECTS) {
+		damage->rects[damage->count++] = r;
+		return;
+	}
+
+	best = 0;
+	best_cost = INT64_MAX;
+	for (i = 0; i < damage->count; i++) {
+		u = damage->rects[i];
+		fb_rect_union(&u, &r);
+		cost = fb_rect_area(&u) - fb_rect_area(&damage->rects[i]);
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = i;
+		}
+	}
+	fb_rect_union(&r, &damage->rects[best]);
+	damage->rects[best] = damage->rects[--damage->count];
+	goto restart;
+}
+
+/* Transform already clipped rectangle from rotated to buffer coordinates. */
+static void fb_rect_to_buffer(fb_t* fb, int32_t x, int32_t y,
+			      uint32_t width, uint32_t height,
+			      struct drm_mode_rect* r)
+{
+	int32_t bw = fb->buffer_properties.width;
+	int32_t bh = fb->buffer_properties.height;
+
+	switch (fb->buffer_properties.rotation) {
+		case DRM_MODE_ROTATE_90:
+			r->x1 = bw - (y + height);
+			r->y1 = x;
+			r->x2 = bw - y;
+			r->y2 = x + width;
+			break;
+		case DRM_MODE_ROTATE_270:
+			r->x1 = y;
+			r->y1 = bh - (x + width);
+			r->x2 = y + height;
+			r->y2 = bh - x;
+			break;
+		case DRM_MODE_ROTATE_180:
+			r->x1 = bw - (x + width);
+			r->y1 = bh - (y + height);
+			r->x2 = bw - x;
+			r->y2 = bh - y;
+			break;
+		case DRM_MODE_ROTATE_0:
+		default:
+			r->x1 = x;
+			r->y1 = y;
+			r->x2 = x + width;
+			r->y2 = y + height;
+	}
+}
+
+static void fb_flush_damage(fb_t* fb, uint32_t fb_id)
+{
+	fb_damage_t* damage = &fb->damage;
+	struct drm_clip_rect clip_rects[FB_MAX_DAMAGE_RECTS];
+	int32_t ret;
+
+	if (!damage->count)
+		return;
+
+	/* Scanout reads the buffer directly, there is nothing to flush. */
+	if (fb->drm->dirty_fb_nosys)
+		goto done;
+
+	/*
+	 * Once DirtyFB showed the driver needs flushing, use atomic damage,
+	 * which does not block. It only applies to the fb on the console plane.
+	 */
+	if (!fb->drm->dirty_fb_needed ||
+	    drm_atomic_damage(fb->drm, fb_id, damage->rects, damage->count)) {
+		for (uint32_t i = 0; i < damage->count; i++) {
+			clip_rects[i].x1 = damage->rects[i].x1;
+			clip_rects[i].y1 = damage->rects[i].y1;
+			clip_rects[i].x2 = damage->rects[i].x2;
+			clip_rects[i].y2 = damage->rects[i].y2;
+		}
+		ret = drmModeDirtyFB(fb->drm->fd, fb_id, clip_rects, damage->count);
+		if (ret) {
+			int loglevel = ERROR;
+			/* Do not print "normal" errors by default. */
+			if (errno == ENOSYS || errno == EACCES)
+				loglevel = DEBUG;
+			if (errno == ENOSYS)
+				fb->drm->dirty_fb_nosys = true;
+			LOG(loglevel, "drmModeDirtyFB failed: %d %m", errno);
+		} else {
+			fb->drm->dirty_fb_needed = true;
+		}
+	}
+
+done:
+	damage->count = 0;
+}
+
+/* Copy damaged area between two buffers of the same fb. */
+static void fb_copy_damage(fb_t* fb, uint32_t* dst, const uint32_t* src,
+			   const fb_damage_t* damage)
+{
+	uint32_t pitch_div_4 = fb->buffer_properties.pitch >> 2;
+
+	for (uint32_t i = 0; i < damage->count; i++) {
+		const struct drm_mode_rect* r = &damage->rects[i];
+		size_t offset = r->y1 * pitch_div_4 + r->x1;
+
+		for (int32_t y = r->y1; y < r->y2; y++) {
+			memcpy(dst + offset, src + offset,
+			       (r->x2 - r->x1) * sizeof(*dst));
+			offset += pitch_div_4;
+		}
+	}
+}
+
+/* Stream damaged area from the shadow buffer to a dumb buffer. */
+static void fb_flush_shadow(fb_t* fb, uint32_t* dst, const fb_damage_t* damage)
+{
+	uint32_t pitch_div_4 = fb->buffer_properties.pitch >> 2;
+
+	for (uint32_t i = 0; i < damage->count; i++) {
+		const struct drm_mode_rect* r = &damage->rects[i];
+		size_t offset = r->y1 * pitch_div_4 + r->x1;
+
+		for (int32_t y = r->y1; y < r->y2; y++) {
+			blit_stream32(dst + offset, fb->shadow + offset,
+				      r->x2 - r->x1);
+			offset += pitch_div_4;
+		}
+	}
+	blit_stream_done();
+}
+
+/* Add |damage| to the stale area of all buffers but |front| and |back|. */
+static void fb_mark_stale(fb_t* fb, const fb_damage_t* damage,
+			  uint32_t front, uint32_t back)
+{
+	for (uint32_t i = 0; i < fb->num_dumb; i++) {
+		if (i == front || i == back)
+			continue;
+		for (uint32_t j = 0; j < damage->count; j++)
+			fb_damage_add(&fb->dumb[i].stale, damage->rects[j]);
+	}
+}
+
+/*
+ * Pick the buffer to draw the next frame into, one that is neither on screen
+ * nor queued to be. With a third buffer there always is one, with only two
+ * wait for the pending flip to release the old front buffer.
+ */
+static void fb_pick_back(fb_t* fb)
+{
+	bool pending = drm_flip_pending(fb->drm);
+
+	for (uint32_t i = 0; i < fb->num_dumb; i++) {
+		if (i == fb->front || (pending && i == fb->prev))
+			continue;
+		fb->back = i;
+		return;
+	}
+
+	drm_wait_flip(fb->drm);
+	fb->back = fb->front ^ 1;
+}
+
+/*
+ * Make back buffer current for drawing. Whatever was presented from other
+ * buffers since the back buffer was last drawn is copied forward first.
+ */
+static void fb_prepare_back(fb_t* fb)
+{
+	fb_dumb_t* back;
+
+	/* Shadow buffer has everything, back buffer is updated on present. */
+	if (fb->shadow) {
+		fb->lock.map = fb->shadow;
+		return;
+	}
+
+	fb_pick_back(fb);
+	back = &fb->dumb[fb->back];
+	fb_copy_damage(fb, back->map, fb->dumb[fb->front].map, &back->stale);
+	back->stale.count = 0;
+	fb->lock.map = back->map;
+}
+
+/*
+ * Present back buffer by flipping to it if this fb is on screen, otherwise
+ * just swap the buffers. While an earlier flip is still pending the frame
+ * goes to the front buffer instead, same as when flipping fails.
+ */
+static void fb_present(fb_t* fb)
+{
+	fb_dumb_t* front = &fb->dumb[fb->front];
+	fb_dumb_t* back;
+	int32_t ret;
+
+	if (!fb->damage.count)
+		return;
+
+	if (fb->shadow) {
+		fb_pick_back(fb);
+		back = &fb->dumb[fb->back];
+		fb_flush_shadow(fb, back->map, &back->stale);
+		fb_flush_shadow(fb, back->map, &fb->damage);
+		back->stale.count = 0;
+	} else {
+		back = &fb->dumb[fb->back];
+	}
+
+	if (fb->drm->console_fb_id == front->fb_id) {
+		ret = drm_page_flip(fb->drm, back->fb_id,
+				    fb->damage.rects, fb->damage.count);
+		if (ret) {
+			LOG(DEBUG, "Page flip failed: %d, updating front buffer.", ret);
+			if (fb->shadow)
+				fb_flush_shadow(fb, front->map, &fb->damage);
+			else
+				fb_copy_damage(fb, front->map, back->map, &fb->damage);
+			fb_mark_stale(fb, &fb->damage, fb->front, fb->back);
+			fb_flush_damage(fb, front->fb_id);
+			return;
+		}
+		fb->prev = fb->front;
+	}
+
+	fb_mark_stale(fb, &fb->damage, fb->back, fb->back);
+	fb->front = fb->back;
+	fb->damage.count = 0;
+}
+
+static int fb_dumb_map(fb_t* fb, fb_dumb_t* dumb)
+{
+	int flags = MAP_SHARED;
+
+	if (command_flags.prefault_fb)
+		flags |= MAP_POPULATE;
+
+	dumb->map = mmap(0, fb->buffer_properties.size, PROT_READ | PROT_WRITE,
+			 flags, fb->drm->fd, dumb->map_offset);
+	if (dumb->map == MAP_FAILED) {
+		LOG(ERROR, "mmap failed");
+		dumb->map = NULL;
+		return -errno;
+	}
+
+	fb_stats.maps++;
+	return 0;
+}
+
+static int fb_dumb_create(fb_t* fb, fb_dumb_t* dumb,
+			  int* pitch)
 {
 	struct drm_mode_create_dumb create_dumb;
 	struct drm_mode_destroy_dumb destroy_dumb;
-	uint32_t* fb_buffer;
 	int ret;
 
 	memset(&create_dumb, 0, sizeof (create_dumb));
@@ -39,7 +375,7 @@ static int fb_buffer_create(fb_t* fb,
 	}
 
 	fb->buffer_properties.size = create_dumb.size;
-	fb->buffer_handle = create_dumb.handle;
+	dumb->handle = create_dumb.handle;
 
 	struct drm_mode_map_dumb map_dumb;
 	map_dumb.handle = create_dumb.handle;
@@ -49,12 +385,12 @@ static int fb_buffer_create(fb_t* fb,
 		goto destroy_buffer;
 	}
 
-	fb->lock.map_offset = map_dumb.offset;
+	dumb->map_offset = map_dumb.offset;
 
 	uint32_t offset = 0;
 	ret = drmModeAddFB2(fb->drm->fd, fb->drm->console_mode_info.hdisplay, fb->drm->console_mode_info.vdisplay,
 			    DRM_FORMAT_XRGB8888, &create_dumb.handle,
-			    &create_dumb.pitch, &offset, &fb->fb_id, 0);
+			    &create_dumb.pitch, &offset, &dumb->fb_id, 0);
 	if (ret) {
 		LOG(ERROR, "drmModeAddFB2 failed");
 		goto destroy_buffer;
@@ -62,36 +398,105 @@ static int fb_buffer_create(fb_t* fb,
 
 	*pitch = create_dumb.pitch;
 
-	fb_buffer = fb_lock(fb);
-	if (fb_buffer) {
-		memset(fb_buffer, 0, fb->buffer_properties.size);
-		fb_unlock(fb);
-	}
+	/* Keep one mapping for the lifetime of the buffer. */
+	ret = fb_dumb_map(fb, dumb);
+	if (ret)
+		goto remove_fb;
+
+	/* Not scanned out yet, no need to report damage. */
+	memset(dumb->map, 0, fb->buffer_properties.size);
 
 	return 0;
 
+remove_fb:
+	drmModeRmFB(fb->drm->fd, dumb->fb_id);
+	dumb->fb_id = 0;
 destroy_buffer:
 	destroy_dumb.handle = create_dumb.handle;
+	dumb->handle = 0;
 
 	drmIoctl(fb->drm->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_dumb);
 
 	return ret;
 }
 
-void fb_buffer_destroy(fb_t* fb)
+static void fb_dumb_destroy(fb_t* fb, fb_dumb_t* dumb, bool delay_rmfb)
 {
 	struct drm_mode_destroy_dumb destroy_dumb;
 
-	if (fb->buffer_handle <= 0)
+	if (dumb->map)
+		munmap(dumb->map, fb->buffer_properties.size);
+	if (delay_rmfb)
+		drm_rmfb(fb->drm, dumb->fb_id);
+	else
+		drmModeRmFB(fb->drm->fd, dumb->fb_id);
+	destroy_dumb.handle = dumb->handle;
+	drmIoctl(fb->drm->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_dumb);
+	memset(dumb, 0, sizeof(*dumb));
+}
+
+static int fb_buffer_create(fb_t* fb,
+			    int* pitch)
+{
+	uint64_t prefer_shadow = 0;
+	int ret;
+
+	ret = fb_dumb_create(fb, &fb->dumb[0], pitch);
+	if (ret)
+		return ret;
+
+	fb->num_dumb = 1;
+	fb->front = 0;
+	fb->back = 0;
+	fb->prev = 0;
+
+	/* A third buffer lets drawing go on while a flip is pending. */
+	if (command_flags.double_buffer) {
+		while (fb->num_dumb < FB_MAX_DUMB &&
+		       fb_dumb_create(fb, &fb->dumb[fb->num_dumb], pitch) == 0)
+			fb->num_dumb++;
+		if (fb->num_dumb == 1)
+			LOG(WARNING, "Failed to create back buffer, single buffering.");
+		else if (fb->num_dumb < FB_MAX_DUMB)
+			LOG(WARNING, "Failed to create third buffer, drawing waits for flips.");
+	}
+
+	/*
+	 * Dumb buffers are usually write-combined, so if the driver says so
+	 * draw into cached memory and only stream out damage on unlock.
+	 */
+	if (drmGetCap(fb->drm->fd, DRM_CAP_DUMB_PREFER_SHADOW, &prefer_shadow) == 0 &&
+	    prefer_shadow) {
+		fb->shadow = (uint32_t*)calloc(1, fb->buffer_properties.size);
+		if (!fb->shadow)
+			LOG(WARNING, "Failed to allocate shadow buffer.");
+	}
+
+	return 0;
+}
+
+void fb_buffer_destroy(fb_t* fb)
+{
+	if (!fb->num_dumb)
 		goto unref_drm;
 
-	drm_rmfb(fb->drm, fb->fb_id);
-	fb->fb_id = 0;
-	destroy_dumb.handle = fb->buffer_handle;
-	drmIoctl(fb->drm->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy_dumb);
-	fb->buffer_handle = 0;
+	drm_wait_flip(fb->drm);
+
+	/* Keep the buffer on screen around till the next modeset. */
+	for (uint32_t i = 0; i < fb->num_dumb; i++)
+		if (i != fb->front)
+			fb_dumb_destroy(fb, &fb->dumb[i], false);
+	fb_dumb_destroy(fb, &fb->dumb[fb->front], true);
+
+	free(fb->shadow);
+	fb->shadow = NULL;
+	fb->num_dumb = 0;
+	fb->front = 0;
+	fb->back = 0;
+	fb->prev = 0;
 	fb->lock.map = NULL;
 	fb->lock.count = 0;
+	fb->damage.count = 0;
 unref_drm:
 	if (fb->drm) {
 		drm_delref(fb->drm);
@@ -264,23 +669,26 @@ int32_t fb_setmode(fb_t* fb)
 	if (!drm_valid(fb->drm))
 		return 0;
 
-	return drm_setmode(fb->drm, fb->fb_id);
+	drm_wait_flip(fb->drm);
+
+	return drm_setmode(fb->drm, fb->dumb[fb->front].fb_id);
 }
 
 uint32_t* fb_lock(fb_t* fb)
 {
-	if (fb->lock.count == 0 && fb->buffer_handle > 0) {
-		fb->lock.map =
-			mmap(0, fb->buffer_properties.size, PROT_READ | PROT_WRITE,
-					MAP_SHARED, fb->drm->fd, fb->lock.map_offset);
-		if (fb->lock.map == MAP_FAILED) {
-			LOG(ERROR, "mmap failed");
-			return NULL;
-		}
-	}
+	if (!fb->num_dumb)
+		return NULL;
 
-	if (fb->lock.map)
-		fb->lock.count++;
+	/* The buffer to draw into is only exposed while locked. */
+	if (fb->lock.count == 0) {
+		if (FB_STATS_ENABLED)
+			fb->lock.faults = fb_get_faults();
+		if (fb->num_dumb > 1)
+			fb_prepare_back(fb);
+		else
+			fb->lock.map = fb->shadow ? fb->shadow : fb->dumb[0].map;
+	}
+	fb->lock.count++;
 
 	return fb->lock.map;
 }
@@ -292,19 +700,19 @@ void fb_unlock(fb_t* fb)
 	else
 		LOG(ERROR, "fb locking unbalanced");
 
-	if (fb->lock.count == 0 && fb->buffer_handle > 0) {
-		int32_t ret;
-		struct drm_clip_rect clip_rect = {
-			0, 0, fb->buffer_properties.width, fb->buffer_properties.height
-		};
-		munmap(fb->lock.map, fb->buffer_properties.size);
-		ret = drmModeDirtyFB(fb->drm->fd, fb->fb_id, &clip_rect, 1);
-		if (ret) {
-			int loglevel = ERROR;
-			/* Do not print "normal" errors by default. */
-			if (errno == ENOSYS || errno == EACCES)
-				loglevel = DEBUG;
-			LOG(loglevel, "drmModeDirtyFB failed: %d %m", errno);
+	if (fb->lock.count == 0 && fb->num_dumb > 0) {
+		if (fb->num_dumb > 1) {
+			fb_present(fb);
+		} else {
+			if (fb->shadow)
+				fb_flush_shadow(fb, fb->dumb[0].map, &fb->damage);
+			fb_flush_damage(fb, fb->dumb[0].fb_id);
+		}
+		fb->lock.map = NULL;
+
+		if (FB_STATS_ENABLED) {
+			fb_stats.faults += fb_get_faults() - fb->lock.faults;
+			fb_report_stats();
 		}
 	}
 }
@@ -342,77 +750,255 @@ int32_t fb_getscaling(fb_t* fb)
 	return fb->buffer_properties.scaling;
 }
 
-bool
-fb_stepper_init(fb_stepper_t *s, fb_t *fb, int32_t x, int32_t y, uint32_t width, uint32_t height)
+int32_t fb_getrotation(fb_t* fb)
 {
-	s->fb = fb;
-	s->start_x = x;
-	s->start_y = y;
-	s->w = width;
-	s->h = height;
-	s->x = 0;
-	s->y = 0;
-	s->pitch_div_4 = s->fb->buffer_properties.pitch >> 2;
+	return fb->buffer_properties.rotation;
+}
 
-	/* quick check if whole rect is outside fb */
-	if (x + width <= 0 || y + height <= 0)
+/* Refresh rate of the display mode in Hz, 0 if unknown. */
+int32_t fb_getrefresh(fb_t* fb)
+{
+	if (!fb->drm)
+		return 0;
+	return drm_getvrefresh(fb->drm);
+}
+
+/*
+ * Clip rectangle against logical framebuffer size. Returns false if nothing
+ * is left, otherwise the clipped rectangle is returned together with offset
+ * of its top left corner inside of the original rectangle.
+ */
+static bool fb_clip_rect(fb_t* fb, int32_t* x, int32_t* y,
+			 uint32_t* width, uint32_t* height,
+			 uint32_t* off_x, uint32_t* off_y)
+{
+	int64_t x0 = *x, y0 = *y;
+	int64_t x1 = x0 + *width, y1 = y0 + *height;
+
+	x0 = MAX(x0, 0);
+	y0 = MAX(y0, 0);
+	x1 = MIN(x1, fb_getwidth(fb));
+	y1 = MIN(y1, fb_getheight(fb));
+	if (x0 >= x1 || y0 >= y1)
 		return false;
 
-	switch (s->fb->buffer_properties.rotation) {
-		case DRM_MODE_ROTATE_90:
-		case DRM_MODE_ROTATE_270:
-			s->max_x = s->fb->buffer_properties.height;
-			s->max_y = s->fb->buffer_properties.width;
-			break;
-		case DRM_MODE_ROTATE_180:
-		case DRM_MODE_ROTATE_0:
-		default:
-			s->max_x = s->fb->buffer_properties.width;
-			s->max_y = s->fb->buffer_properties.height;
-	}
+	*off_x = x0 - *x;
+	*off_y = y0 - *y;
+	*x = x0;
+	*y = y0;
+	*width = x1 - x0;
+	*height = y1 - y0;
+	return true;
+}
 
-	if (x >= s->max_x
-	    || y >= s->max_y)
+/* Add rectangle in buffer coordinates to damage, unless deferred. */
+static void fb_damage_buffer_rect(fb_t* fb, struct drm_mode_rect r)
+{
+	if (!fb->damage_deferred)
+		fb_damage_add(&fb->damage, r);
+}
+
+void fb_defer_damage(fb_t* fb, bool defer)
+{
+	fb->damage_deferred = defer;
+}
+
+/* Add rectangle in rotated coordinates to damage. */
+void fb_damage_rect(fb_t* fb, int32_t x, int32_t y,
+		    uint32_t width, uint32_t height)
+{
+	struct drm_mode_rect r;
+	uint32_t off_x, off_y;
+
+	if (!fb_clip_rect(fb, &x, &y, &width, &height, &off_x, &off_y))
+		return;
+
+	fb_rect_to_buffer(fb, x, y, width, height, &r);
+	fb_damage_add(&fb->damage, r);
+}
+
+void fb_fill_rect(fb_t* fb, int32_t x, int32_t y, uint32_t width, uint32_t height,
+		  uint32_t rgba)
+{
+	uint32_t pitch_div_4 = fb->buffer_properties.pitch >> 2;
+	uint32_t off_x, off_y;
+	struct drm_mode_rect r;
+	uint32_t* dst;
+
+	if (!fb->lock.map)
+		return;
+
+	if (!fb_clip_rect(fb, &x, &y, &width, &height, &off_x, &off_y))
+		return;
+
+	/* A solid fill looks the same in every orientation. */
+	fb_rect_to_buffer(fb, x, y, width, height, &r);
+	fb_damage_buffer_rect(fb, r);
+
+	dst = fb->lock.map + r.y1 * pitch_div_4 + r.x1;
+	for (int32_t j = r.y1; j < r.y2; j++, dst += pitch_div_4)
+		blit_fill32(dst, rgba, r.x2 - r.x1);
+}
+
+/* Whether fb_move_rect() can move pixels at all. */
+bool fb_can_move_rect(fb_t* fb)
+{
+	return fb->shadow != NULL;
+}
+
+/*
+ * Move the contents of a rectangle |dy| pixels down, or up if negative, as
+ * far as both source and destination are on the framebuffer. This is only
+ * done when drawing into the shadow buffer, reading back from the dumb
+ * buffer would be slower than drawing again. Returns false if nothing was
+ * moved.
+ */
+bool fb_move_rect(fb_t* fb, int32_t x, int32_t y, uint32_t width,
+		  uint32_t height, int32_t dy)
+{
+	uint32_t pitch_div_4 = fb->buffer_properties.pitch >> 2;
+	uint32_t off_x, off_y;
+	struct drm_mode_rect src, dst;
+	int32_t dst_y, rows;
+	uint32_t* map;
+
+	if (!fb->lock.map || !fb_can_move_rect(fb) || !dy)
 		return false;
 
-	switch (s->fb->buffer_properties.rotation) {
-		case DRM_MODE_ROTATE_90:
-			s->m[0][0] = 0;
-			s->m[0][1] = -1;
-			s->m[0][2] = s->fb->buffer_properties.width - 1;
+	if (!fb_clip_rect(fb, &x, &y, &width, &height, &off_x, &off_y))
+		return false;
+	dst_y = y + dy;
+	if (!fb_clip_rect(fb, &x, &dst_y, &width, &height, &off_x, &off_y))
+		return false;
+	y = dst_y - dy;
+
+	fb_rect_to_buffer(fb, x, y, width, height, &src);
+	fb_rect_to_buffer(fb, x, dst_y, width, height, &dst);
+	fb_damage_add(&fb->damage, dst);
+
+	/* Walk rows so that overlapping source rows are read before written. */
+	map = fb->lock.map;
+	rows = dst.y2 - dst.y1;
+	for (int32_t j = 0; j < rows; j++) {
+		int32_t row = dst.y1 > src.y1 ? rows - 1 - j : j;
+		memmove(map + (dst.y1 + row) * pitch_div_4 + dst.x1,
+			map + (src.y1 + row) * pitch_div_4 + src.x1,
+			(dst.x2 - dst.x1) * sizeof(*map));
+	}
+	return true;
+}
+
+/*
+ * Copy kernels, one per rotation. They walk the destination in buffer
+ * order so writes stay row-contiguous, and read the source with |DX| step
+ * per buffer pixel and |DY| step per buffer row, starting at |BASE|. When
+ * the source is read along columns (90/270) the rect is walked in square
+ * tiles so the source rows being read stay in cache.
+ */
+#define FB_COPY_TILE 32
+
+#define FB_COPY_KERNEL(name, BASE, DX, DY)				\
+static void name(uint32_t* dst, uint32_t dst_pitch,			\
+		 uint32_t bw, uint32_t bh, const uint32_t* src,		\
+		 uint32_t width, uint32_t height, uint32_t src_pitch)	\
+{									\
+	const ptrdiff_t dx = (DX), dy = (DY);				\
+	const uint32_t tile = (dx == 1 || dx == -1) ? bw : FB_COPY_TILE; \
+									\
+	src += (BASE);							\
+	for (uint32_t ty = 0; ty < bh; ty += tile) {			\
+		uint32_t th = MIN(tile, bh - ty);			\
+		for (uint32_t tx = 0; tx < bw; tx += tile) {		\
+			uint32_t tw = MIN(tile, bw - tx);		\
+			for (uint32_t j = ty; j < ty + th; j++) {	\
+				uint32_t* d = dst + j * dst_pitch + tx;	\
+				const uint32_t* s = src + (ptrdiff_t)j * dy \
+						    + (ptrdiff_t)tx * dx; \
+				if (dx == 1) {				\
+					blit_copy32(d, s, tw);		\
+					continue;			\
+				}					\
+				for (uint32_t i = 0; i < tw; i++, s += dx) \
+					d[i] = *s;			\
+			}						\
+		}							\
+	}								\
+}
+
+FB_COPY_KERNEL(fb_copy_rotate_0, 0, 1, (ptrdiff_t)src_pitch)
+FB_COPY_KERNEL(fb_copy_rotate_90, (height - 1) * (ptrdiff_t)src_pitch,
+	       -(ptrdiff_t)src_pitch, 1)
+FB_COPY_KERNEL(fb_copy_rotate_180,
+	       (height - 1) * (ptrdiff_t)src_pitch + width - 1,
+	       -1, -(ptrdiff_t)src_pitch)
+FB_COPY_KERNEL(fb_copy_rotate_270, width - 1, (ptrdiff_t)src_pitch, -1)
+
+void fb_copy_rect(fb_t* fb, int32_t x, int32_t y, uint32_t width, uint32_t height,
+		  const uint32_t* src, uint32_t src_pitch)
+{
+	uint32_t pitch_div_4 = fb->buffer_properties.pitch >> 2;
+	uint32_t off_x, off_y, bw, bh;
+	struct drm_mode_rect r;
+	uint32_t* dst;
+
+	if (!fb->lock.map)
+		return;
+
+	if (!fb_clip_rect(fb, &x, &y, &width, &height, &off_x, &off_y))
+		return;
+
+	fb_rect_to_buffer(fb, x, y, width, height, &r);
+	fb_damage_buffer_rect(fb, r);
+
+	src += off_y * src_pitch + off_x;
+	dst = fb->lock.map + r.y1 * pitch_div_4 + r.x1;
+	bw = r.x2 - r.x1;
+	bh = r.y2 - r.y1;
 
-			s->m[1][0] = 1;
-			s->m[1][1] = 0;
-			s->m[1][2] = 0;
+	switch (fb->buffer_properties.rotation) {
+		case DRM_MODE_ROTATE_90:
+			fb_copy_rotate_90(dst, pitch_div_4, bw, bh, src,
+					  width, height, src_pitch);
 			break;
 		case DRM_MODE_ROTATE_270:
-			s->m[0][0] = 0;
-			s->m[0][1] = 1;
-			s->m[0][2] = 0;
-
-			s->m[1][0] = -1;
-			s->m[1][1] = 0;
-			s->m[1][2] = s->fb->buffer_properties.height - 1;
+			fb_copy_rotate_270(dst, pitch_div_4, bw, bh, src,
+					   width, height, src_pitch);
 			break;
 		case DRM_MODE_ROTATE_180:
-			s->m[0][0] = -1;
-			s->m[0][1] = 0;
-			s->m[0][2] = s->fb->buffer_properties.width - 1;
-
-			s->m[1][0] = 0;
-			s->m[1][1] = -1;
-			s->m[1][2] = s->fb->buffer_properties.height - 1;
+			fb_copy_rotate_180(dst, pitch_div_4, bw, bh, src,
+					   width, height, src_pitch);
 			break;
 		case DRM_MODE_ROTATE_0:
 		default:
-			s->m[0][0] = 1;
-			s->m[0][1] = 0;
-			s->m[0][2] = 0;
-
-			s->m[1][0] = 0;
-			s->m[1][1] = 1;
-			s->m[1][2] = 0;
+			fb_copy_rotate_0(dst, pitch_div_4, bw, bh, src,
+					 width, height, src_pitch);
 	}
+}
 
-	return true;
+void fb_copy_rect_prerotated(fb_t* fb, int32_t x, int32_t y,
+			     uint32_t width, uint32_t height,
+			     const uint32_t* src, uint32_t src_pitch)
+{
+	uint32_t pitch_div_4 = fb->buffer_properties.pitch >> 2;
+	struct drm_mode_rect full, r;
+	uint32_t off_x, off_y;
+	uint32_t* dst;
+
+	if (!fb->lock.map)
+		return;
+
+	fb_rect_to_buffer(fb, x, y, width, height, &full);
+	if (!fb_clip_rect(fb, &x, &y, &width, &height, &off_x, &off_y))
+		return;
+
+	fb_rect_to_buffer(fb, x, y, width, height, &r);
+	fb_damage_buffer_rect(fb, r);
+
+	src += (r.y1 - full.y1) * src_pitch + (r.x1 - full.x1);
+	dst = fb->lock.map + r.y1 * pitch_div_4 + r.x1;
+	for (int32_t j = r.y1; j < r.y2; j++) {
+		blit_copy32(dst, src, r.x2 - r.x1);
+		dst += pitch_div_4;
+		src += src_pitch;
+	}
 }
@@ -20,28 +20,42 @@ typedef struct {
 
 typedef struct {
 	int32_t count;
-	uint64_t map_offset;
-	uint32_t* map;
+	uint32_t* map; // buffer to draw into, NULL while unlocked
+	long faults; // page fault count when the lock was taken
 } fb_lock_t;
 
+#define FB_MAX_DAMAGE_RECTS 16
+
+/* Damaged area accumulated while locked, in buffer (unrotated) coordinates. */
+typedef struct {
+	uint32_t count;
+	struct drm_mode_rect rects[FB_MAX_DAMAGE_RECTS];
+} fb_damage_t;
+
+typedef struct {
+	uint32_t handle;
+	uint32_t fb_id;
+	uint64_t map_offset;
+	uint32_t* map; // mapped for the lifetime of the dumb buffer
+	fb_damage_t stale; // presented from other buffers since last drawn
+} fb_dumb_t;
+
+#define FB_MAX_DUMB 3
+
 typedef struct {
 	drm_t *drm;
 	buffer_properties_t buffer_properties;
 	fb_lock_t lock;
-	uint32_t buffer_handle;
-	uint32_t fb_id;
+	fb_damage_t damage;
+	fb_dumb_t dumb[FB_MAX_DUMB]; // front and, when double buffering, back buffers
+	uint32_t num_dumb;
+	uint32_t front;
+	uint32_t back; // drawn into while locked
+	uint32_t prev; // front before the last flip, scanned out till it completes
+	uint32_t* shadow; // cached copy drawn into, NULL if drawing directly
+	bool damage_deferred; // see fb_defer_damage()
 } fb_t;
 
-typedef struct {
-	fb_t *fb;
-	int32_t start_x, start_y;
-	uint32_t w, h;
-	uint32_t x, y;
-	int32_t max_x, max_y;
-	uint32_t pitch_div_4;
-	int32_t m[2][3];
-} fb_stepper_t;
-
 fb_t* fb_init(void);
 void fb_close(fb_t* fb);
 int32_t fb_setmode(fb_t* fb);
@@ -52,33 +66,36 @@ void fb_unlock(fb_t* fb);
 int32_t fb_getwidth(fb_t* fb);
 int32_t fb_getheight(fb_t* fb);
 int32_t fb_getscaling(fb_t* fb);
-bool fb_stepper_init(fb_stepper_t *s, fb_t *fb, int32_t x, int32_t y, uint32_t width, uint32_t height);
-
-bool static inline fb_stepper_step_x(fb_stepper_t *s, uint32_t rgba)
-{
-	int32_t x = s->start_x + s->x;
-	int32_t y = s->start_y + s->y;
-	int32_t p;
-
-	if (x >= 0 && x < s->max_x
-	    && y >= 0 && y < s->max_y) {
-		p = (x * s->m[0][0] + y * s->m[0][1] + s->m[0][2])
-		  + (x * s->m[1][0] + y * s->m[1][1] + s->m[1][2]) * s->pitch_div_4;
-		s->fb->lock.map[p] = rgba;
-	}
+int32_t fb_getrotation(fb_t* fb);
+int32_t fb_getrefresh(fb_t* fb);
 
-	s->x++;
-	if (s->x >= s->w) {
-		s->x = 0;
-		return false;
-	}
-	return true;
-}
-
-bool inline fb_stepper_step_y(fb_stepper_t *s)
-{
-	s->y++;
-	return s->y < s->h;
-}
+/*
+ * Rectangle operations. Coordinates are in rotated (logical) space, the
+ * rectangle is clipped once against the framebuffer and written out in whole
+ * row spans. The framebuffer has to be locked. |src_pitch| is in pixels.
+ */
+void fb_fill_rect(fb_t* fb, int32_t x, int32_t y, uint32_t width, uint32_t height,
+		  uint32_t rgba);
+void fb_copy_rect(fb_t* fb, int32_t x, int32_t y, uint32_t width, uint32_t height,
+		  const uint32_t* src, uint32_t src_pitch);
+/*
+ * While damage is deferred the rectangle operations above do not record it,
+ * so they can run on several threads at once as long as the rectangles do
+ * not overlap. The caller then adds the damage with fb_damage_rect().
+ */
+void fb_defer_damage(fb_t* fb, bool defer);
+void fb_damage_rect(fb_t* fb, int32_t x, int32_t y,
+		    uint32_t width, uint32_t height);
+/* Move the pixels of a rectangle vertically by |dy|, see fb.c. */
+bool fb_can_move_rect(fb_t* fb);
+bool fb_move_rect(fb_t* fb, int32_t x, int32_t y, uint32_t width,
+		  uint32_t height, int32_t dy);
+/*
+ * Same as fb_copy_rect(), but |src| is already rotated into buffer
+ * orientation, so it is height x width pixels for 90/270 rotations.
+ */
+void fb_copy_rect_prerotated(fb_t* fb, int32_t x, int32_t y,
+			     uint32_t width, uint32_t height,
+			     const uint32_t* src, uint32_t src_pitch);
 
 #endif
@@ -4,7 +4,13 @@
  * found in the LICENSE file.
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "font.h"
 #include "glyphs.h"
@@ -12,10 +18,208 @@
 
 #define UNICODE_REPLACEMENT_CHARACTER_CODE_POINT 0xFFFD
 
-static int font_scaling = 0;
-static int glyph_size = GLYPH_BYTES_PER_ROW * GLYPH_HEIGHT;
-static uint8_t* prescaled_glyphs = NULL;
-static int font_ref = 0;
+#define FONT_CACHE_ENTRIES 512
+#define FONT_CACHE_BUCKETS 1024 /* power of 2 */
+#define FONT_CACHE_STATS_INTERVAL_MS (5 * MS_PER_SEC)
+#define FONT_SLAB_GLYPHS 64
+#define FONT_COMPOSE_ENTRIES 64
+#define FONT_COMPOSE_MAX_CHARS 8 /* further combining marks are dropped */
+#define FONT_MAX_IDLE 2 /* unreferenced fonts kept resident */
+
+/* Largest cell, in pixels and bitmap bytes, any font may produce. */
+#define FONT_MAX_CELL_PIXELS \
+	(GLYPH_WIDTH * GLYPH_HEIGHT * FONT_MAX_SCALING * FONT_MAX_SCALING)
+#define FONT_MAX_GLYPH_BYTES \
+	(GLYPH_BYTES_PER_ROW * GLYPH_HEIGHT * FONT_MAX_SCALING * FONT_MAX_SCALING)
+
+#define PSF2_MAGIC 0x864ab572
+#define PSF2_HAS_UNICODE_TABLE 0x1
+#define PSF2_SEPARATOR 0xff
+#define PSF2_STARTSEQ 0xfe
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t flags;
+	uint32_t length;
+	uint32_t char_size;
+	uint32_t height;
+	uint32_t width;
+} psf2_header_t;
+
+/*
+ * Bitmap font glyphs are taken from, either the one compiled in from
+ * glyphs.h or one mapped from a file. Bitmaps are stored row by row, most
+ * significant bit first.
+ */
+typedef struct {
+	uint32_t width;
+	uint32_t height;
+	uint32_t bytes_per_row;
+	uint32_t glyph_size;
+	uint32_t count;
+	const uint8_t* bitmaps;
+	int32_t (*lookup)(uint32_t code_point);
+} font_source_t;
+
+static const font_source_t builtin_source = {
+	.width = GLYPH_WIDTH,
+	.height = GLYPH_HEIGHT,
+	.bytes_per_row = GLYPH_BYTES_PER_ROW,
+	.glyph_size = GLYPH_BYTES_PER_ROW * GLYPH_HEIGHT,
+	.count = ARRAY_SIZE(glyphs),
+	.bitmaps = &glyphs[0][0],
+	.lookup = code_point_to_glyph_index,
+};
+
+/* Font loaded by font_load(), the mapping is kept for the process lifetime. */
+typedef struct {
+	uint32_t code_point;
+	uint32_t glyph_index;
+} font_map_entry_t;
+
+static font_source_t file_source;
+static font_map_entry_t* file_map;
+static uint32_t file_map_count;
+
+/*
+ * Fallback font for code points missing from the font in use, in the paged
+ * format written by font_to_c.py --paged. Every page covers 256 code points
+ * and is only paged in once one of them is drawn.
+ */
+#define FONT_PAGED_MAGIC 0x46505246
+#define FONT_PAGED_VERSION 1
+#define FONT_PAGED_SHIFT 8
+#define FONT_PAGED_SIZE (1 << FONT_PAGED_SHIFT)
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t cell_width;
+	uint32_t height;
+	uint32_t bytes_per_row;
+	uint32_t glyph_size;
+	uint32_t page_count;
+	uint32_t reserved;
+} font_paged_header_t;
+
+static struct {
+	uint8_t* data;
+	size_t size;
+	const font_paged_header_t* header;
+	const uint32_t* directory;
+	/* Per page, whether it was referenced yet. */
+	uint8_t* resident;
+	uint32_t resident_count;
+} fallback;
+
+/* Fallback glyphs are at most two cells wide. */
+#define FONT_MAX_WIDE_PIXELS (2 * FONT_MAX_CELL_PIXELS)
+#define FONT_MAX_WIDE_BYTES (4 * FONT_MAX_GLYPH_BYTES)
+
+/*
+ * LRU cache of glyphs expanded to XRGB with a given color pair, laid out the
+ * same way as they are written to the framebuffer. Entries are chained in
+ * hash buckets and kept on a doubly linked list in order of use.
+ */
+typedef struct {
+	int32_t glyph_index; /* -1 if unused */
+	uint32_t front_color;
+	uint32_t back_color;
+	int32_t hash_next;
+	int32_t lru_prev;
+	int32_t lru_next;
+} font_cache_entry_t;
+
+typedef struct {
+	font_cache_entry_t entries[FONT_CACHE_ENTRIES];
+	int32_t buckets[FONT_CACHE_BUCKETS];
+	int32_t lru_head; /* most recently used */
+	int32_t lru_tail;
+	uint32_t* tiles; /* NULL if the cache is disabled */
+	uint32_t tile_pixels;
+	uint64_t hits;
+	uint64_t misses;
+	int64_t last_report_ms;
+} font_cache_t;
+
+/*
+ * Cells with combining characters, composed into one glyph bitmap keyed by
+ * the whole code point sequence. Composites get glyph indices past the end
+ * of the font which are never reused, so their tiles go through the tile
+ * cache like any other glyph and stale tiles simply age out.
+ */
+typedef struct {
+	uint32_t code_points[FONT_COMPOSE_MAX_CHARS];
+	uint32_t len; /* 0 if unused */
+	uint32_t hash;
+	int32_t glyph_index;
+	uint64_t last_use;
+} font_compose_entry_t;
+
+typedef struct {
+	font_compose_entry_t entries[FONT_COMPOSE_ENTRIES];
+	uint8_t* bitmaps; /* allocated with the first composed cell */
+	int32_t next_index;
+	uint64_t uses;
+	uint64_t hits;
+	uint64_t misses;
+	int64_t last_report_ms;
+} font_compose_t;
+
+/*
+ * Glyph set for one scale factor and rotation. Fonts stay resident after the
+ * last reference is dropped, so switching between scales (zoom) does not have
+ * to prepare glyphs again. Only FONT_MAX_IDLE unreferenced fonts are kept,
+ * the one released longest ago is evicted first.
+ */
+struct _font_t {
+	font_t* next;
+	int scaling;
+	/* Glyphs come from |source| scaled by |glyph_scaling|. */
+	const font_source_t* source;
+	int glyph_scaling;
+	/*
+	 * On rotated panels glyphs are kept rotated into framebuffer
+	 * orientation, so a cell is written out as whole framebuffer rows.
+	 */
+	int32_t rotation;
+	int ref;
+	int64_t release_ms;
+
+	/*
+	 * Glyphs scaled and rotated for this font, prepared on first use.
+	 * |glyph_slots| maps a glyph index to its slot, or -1 if the glyph was
+	 * not needed yet. Slots are carved out of slabs which are allocated as
+	 * they fill.
+	 */
+	int32_t* glyph_slots;
+	uint8_t** glyph_slabs;
+	uint32_t glyph_slots_used;
+	int glyph_size;
+	int glyph_bytes_per_row;
+
+	font_cache_t cache;
+	font_compose_t compose;
+};
+
+static font_t* fonts = NULL;
+
+/*
+ * scale_pixel() results for all 512 neighborhoods, one table per scale
+ * factor as fonts of several scales can be in use at once, see
+ * build_scale_patterns().
+ */
+static uint16_t scale_patterns[FONT_MAX_SCALING + 1][512];
+static bool scale_patterns_ready[FONT_MAX_SCALING + 1];
+
+/*
+ * For every glyph bitmap byte, a mask per pixel that is all ones where the
+ * bit is set, so a byte expands to 8 pixels without testing single bits.
+ */
+static uint32_t expand_masks[256][8];
+static bool expand_masks_ready = false;
 
 static uint8_t get_bit(const uint8_t* buffer, int bit_offset)
 {
@@ -27,11 +231,12 @@ static void set_bit(uint8_t* buffer, int bit_offset)
 	buffer[bit_offset / 8] |= (0x1 << (7 - (bit_offset % 8)));
 }
 
-static uint8_t glyph_pixel(const uint8_t* glyph, int x, int y)
+static uint8_t glyph_pixel(const font_source_t* source, const uint8_t* glyph,
+			   int x, int y)
 {
-	if (x < 0 || x >= GLYPH_WIDTH || y < 0 || y >= GLYPH_HEIGHT)
+	if (x < 0 || x >= (int)source->width || y < 0 || y >= (int)source->height)
 		return 0;
-	return get_bit(&glyph[y * GLYPH_BYTES_PER_ROW], x);
+	return get_bit(&glyph[y * source->bytes_per_row], x);
 }
 
 static uint8_t scale_pixel(uint32_t neighbors, int sx, int sy, int scaling)
@@ -108,132 +313,1228 @@ static uint8_t scale_pixel(uint32_t neighbors, int sx, int sy, int scaling)
 	}
 }
 
-static void scale_glyph(uint8_t* dst, const uint8_t* src, int scaling)
+/*
+ * Build the scaled block for every 3x3 neighborhood, once per scale factor.
+ * Bit (sy * scaling + sx) of an entry is the result of scale_pixel() for
+ * that sub-pixel.
+ */
+static const uint16_t* build_scale_patterns(int scaling)
+{
+	if (scale_patterns_ready[scaling])
+		return scale_patterns[scaling];
+
+	for (uint32_t neighbors = 0; neighbors < 512; neighbors++) {
+		uint16_t pattern = 0;
+		for (int sy = 0; sy < scaling; sy++)
+			for (int sx = 0; sx < scaling; sx++)
+				if (scale_pixel(neighbors, sx, sy, scaling))
+					pattern |= 1 << (sy * scaling + sx);
+		scale_patterns[scaling][neighbors] = pattern;
+	}
+	scale_patterns_ready[scaling] = true;
+	return scale_patterns[scaling];
+}
+
+static void scale_glyph(const font_source_t* source, uint8_t* dst,
+			const uint8_t* src, int scaling)
 {
-	for (int y = 0; y < GLYPH_HEIGHT; y++) {
-		for (int x = 0; x < GLYPH_WIDTH; x++) {
+	const uint16_t* patterns = build_scale_patterns(scaling);
+	uint16_t row_mask = (1 << scaling) - 1;
+
+	for (int y = 0; y < (int)source->height; y++) {
+		for (int x = 0; x < (int)source->width; x++) {
 			uint32_t neighbors = 0;
 			for (int dy = -1; dy <= 1; dy++) {
 				for (int dx = -1; dx <= 1; dx++) {
 					neighbors <<= 1;
-					neighbors |= glyph_pixel(
+					neighbors |= glyph_pixel(source,
 						src, x + dx, y + dy);
 				}
 			}
-			for (int sy = 0; sy < scaling; sy++) {
+
+			uint16_t pattern = patterns[neighbors];
+			for (int sy = 0; sy < scaling; sy++, pattern >>= scaling) {
 				uint8_t* dst_row = &dst[(y * scaling + sy) *
-					GLYPH_BYTES_PER_ROW * scaling];
-				for (int sx = 0; sx < scaling; sx++) {
-					if (scale_pixel(neighbors, sx, sy,
-							scaling)) {
+					source->bytes_per_row * scaling];
+				uint16_t bits = pattern & row_mask;
+				for (int sx = 0; bits; sx++, bits >>= 1) {
+					if (bits & 1)
 						set_bit(dst_row,
 							x * scaling + sx);
-					}
 				}
 			}
 		}
 	}
 }
 
-static void prescale_font(int scaling)
+/*
+ * Size of a glyph cell in framebuffer orientation, i.e. with width and height
+ * swapped for 90/270 degree rotations.
+ */
+static void rotated_cell_size(font_t* font, uint32_t* width, uint32_t* height)
+{
+	switch (font->rotation) {
+		case DRM_MODE_ROTATE_90:
+		case DRM_MODE_ROTATE_270:
+			*width = font->source->height * font->glyph_scaling;
+			*height = font->source->width * font->glyph_scaling;
+			break;
+		default:
+			*width = font->source->width * font->glyph_scaling;
+			*height = font->source->height * font->glyph_scaling;
+	}
+}
+
+/* Rotates a |width| x |height| bitmap into framebuffer orientation. */
+static void rotate_bitmap(int32_t rotation, uint8_t* dst, int dst_bytes_per_row,
+			  const uint8_t* src, int src_bytes_per_row,
+			  int width, int height)
+{
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			int bx, by;
+
+			if (!get_bit(&src[y * src_bytes_per_row], x))
+				continue;
+
+			switch (rotation) {
+				case DRM_MODE_ROTATE_90:
+					bx = height - 1 - y;
+					by = x;
+					break;
+				case DRM_MODE_ROTATE_270:
+					bx = y;
+					by = width - 1 - x;
+					break;
+				case DRM_MODE_ROTATE_180:
+				default:
+					bx = width - 1 - x;
+					by = height - 1 - y;
+			}
+			set_bit(&dst[by * dst_bytes_per_row], bx);
+		}
+	}
+}
+
+static void rotate_glyph(font_t* font, uint8_t* dst, const uint8_t* src)
+{
+	rotate_bitmap(font->rotation, dst, font->glyph_bytes_per_row,
+		      src, font->source->bytes_per_row * font->glyph_scaling,
+		      font->source->width * font->glyph_scaling,
+		      font->source->height * font->glyph_scaling);
+}
+
+/* Returns the glyph as scaled at build time, or NULL if not available. */
+static const uint8_t* get_prescaled_glyph(font_t* font, int32_t glyph_index)
+{
+#if defined(GLYPH_PRESCALED_MAX)
+	static const uint8_t* const glyphs_scaled[GLYPH_PRESCALED_MAX + 1] = {
+		[2] = &glyphs_scaled_2[0][0],
+		[3] = &glyphs_scaled_3[0][0],
+		[4] = &glyphs_scaled_4[0][0],
+	};
+
+	if (font->source == &builtin_source &&
+	    font->glyph_scaling > 1 && font->glyph_scaling <= GLYPH_PRESCALED_MAX)
+		return &glyphs_scaled[font->glyph_scaling][glyph_index *
+			GLYPH_BYTES_PER_ROW * GLYPH_HEIGHT *
+			font->glyph_scaling * font->glyph_scaling];
+#endif
+	return NULL;
+}
+
+static void prepare_glyph(font_t* font, uint8_t* dst, int32_t glyph_index)
+{
+	uint8_t scaled[FONT_MAX_GLYPH_BYTES];
+	const uint8_t* src = &font->source->bitmaps[glyph_index *
+						   font->source->glyph_size];
+
+	if (font->rotation == DRM_MODE_ROTATE_0) {
+		scale_glyph(font->source, dst, src, font->glyph_scaling);
+		return;
+	}
+
+	if (get_prescaled_glyph(font, glyph_index)) {
+		src = get_prescaled_glyph(font, glyph_index);
+	} else if (font->glyph_scaling > 1) {
+		memset(scaled, 0, sizeof(scaled));
+		scale_glyph(font->source, scaled, src, font->glyph_scaling);
+		src = scaled;
+	}
+	rotate_glyph(font, dst, src);
+}
+
+/* Returns glyph bitmap as drawn, scaling and rotating it on first use. */
+static const uint8_t* font_get_glyph(font_t* font, int32_t glyph_index)
+{
+	uint32_t slot;
+	uint8_t* dst;
+
+	if (font->glyph_scaling == 1 && font->rotation == DRM_MODE_ROTATE_0)
+		return &font->source->bitmaps[glyph_index *
+					      font->source->glyph_size];
+
+	if (font->rotation == DRM_MODE_ROTATE_0 &&
+	    get_prescaled_glyph(font, glyph_index))
+		return get_prescaled_glyph(font, glyph_index);
+
+	if (!font->glyph_slots)
+		return NULL;
+
+	if (font->glyph_slots[glyph_index] >= 0) {
+		slot = font->glyph_slots[glyph_index];
+		return &font->glyph_slabs[slot / FONT_SLAB_GLYPHS]
+					 [(slot % FONT_SLAB_GLYPHS) * font->glyph_size];
+	}
+
+	slot = font->glyph_slots_used;
+	if (slot % FONT_SLAB_GLYPHS == 0) {
+		font->glyph_slabs[slot / FONT_SLAB_GLYPHS] =
+			(uint8_t*)calloc(FONT_SLAB_GLYPHS, font->glyph_size);
+		if (!font->glyph_slabs[slot / FONT_SLAB_GLYPHS]) {
+			LOG(WARNING, "Failed to allocate glyph slab.");
+			return NULL;
+		}
+	}
+
+	dst = &font->glyph_slabs[slot / FONT_SLAB_GLYPHS]
+				[(slot % FONT_SLAB_GLYPHS) * font->glyph_size];
+	prepare_glyph(font, dst, glyph_index);
+	font->glyph_slots[glyph_index] = slot;
+	font->glyph_slots_used++;
+	return dst;
+}
+
+static int font_glyphs_init(font_t* font)
+{
+	uint32_t glyph_count = font->source->count;
+	uint32_t width, height;
+
+	rotated_cell_size(font, &width, &height);
+	if (font->rotation == DRM_MODE_ROTATE_0)
+		font->glyph_bytes_per_row =
+			font->source->bytes_per_row * font->glyph_scaling;
+	else
+		font->glyph_bytes_per_row = (width + 7) / 8;
+	font->glyph_size = font->glyph_bytes_per_row * height;
+
+	if (font->rotation == DRM_MODE_ROTATE_0 &&
+	    (font->glyph_scaling == 1 || get_prescaled_glyph(font, 0)))
+		return 0;
+
+	font->glyph_slots_used = 0;
+	font->glyph_slots = (int32_t*)malloc(glyph_count *
+					     sizeof(*font->glyph_slots));
+	font->glyph_slabs = (uint8_t**)calloc(
+		(glyph_count + FONT_SLAB_GLYPHS - 1) / FONT_SLAB_GLYPHS,
+		sizeof(*font->glyph_slabs));
+	if (!font->glyph_slots || !font->glyph_slabs) {
+		LOG(ERROR, "Failed to allocate glyph slots.");
+		return -ENOMEM;
+	}
+	for (uint32_t i = 0; i < glyph_count; i++)
+		font->glyph_slots[i] = -1;
+	return 0;
+}
+
+static void font_glyphs_free(font_t* font)
+{
+	if (font->glyph_slots)
+		LOG(DEBUG, "font: %u of %u glyphs were scaled at %dx",
+		    font->glyph_slots_used, font->source->count,
+		    font->glyph_scaling);
+
+	if (font->glyph_slabs) {
+		for (uint32_t i = 0; i < font->glyph_slots_used;
+		     i += FONT_SLAB_GLYPHS)
+			free(font->glyph_slabs[i / FONT_SLAB_GLYPHS]);
+		free(font->glyph_slabs);
+		font->glyph_slabs = NULL;
+	}
+	free(font->glyph_slots);
+	font->glyph_slots = NULL;
+	font->glyph_slots_used = 0;
+	free(font->compose.bitmaps);
+	font->compose.bitmaps = NULL;
+}
+
+static void init_expand_masks(void)
+{
+	if (expand_masks_ready)
+		return;
+
+	for (int byte = 0; byte < 256; byte++)
+		for (int bit = 0; bit < 8; bit++)
+			expand_masks[byte][bit] =
+				(byte & (0x80 >> bit)) ? 0xffffffff : 0;
+	expand_masks_ready = true;
+}
+
+/* Expand |width| bits of a glyph row, 8 pixels per bitmap byte. */
+static void expand_row(uint32_t* dst, const uint8_t* src, uint32_t width,
+		       uint32_t front_color, uint32_t back_color)
+{
+	uint32_t diff = front_color ^ back_color;
+	uint32_t x;
+
+	for (x = 0; x + 8 <= width; x += 8, dst += 8) {
+		const uint32_t* mask = expand_masks[src[x / 8]];
+		for (int i = 0; i < 8; i++)
+			dst[i] = back_color ^ (diff & mask[i]);
+	}
+	for (; x < width; x++)
+		*dst++ = get_bit(src, x) ? front_color : back_color;
+}
+
+static void font_cache_report_stats(font_cache_t* cache, bool force)
+{
+	int64_t now_ms = get_monotonic_time_ms();
+	uint64_t lookups = cache->hits + cache->misses;
+
+	if (!lookups)
+		return;
+	if (!force && now_ms - cache->last_report_ms < FONT_CACHE_STATS_INTERVAL_MS)
+		return;
+
+	LOG(DEBUG, "font: tile cache %llu hits, %llu misses (%.1f%% hit rate)",
+	    (unsigned long long)cache->hits,
+	    (unsigned long long)cache->misses,
+	    cache->hits * 100.0 / lookups);
+	cache->hits = 0;
+	cache->misses = 0;
+	cache->last_report_ms = now_ms;
+}
+
+static void font_compose_report_stats(font_compose_t* compose, bool force)
+{
+	int64_t now_ms = get_monotonic_time_ms();
+	uint64_t lookups = compose->hits + compose->misses;
+
+	if (!lookups)
+		return;
+	if (!force &&
+	    now_ms - compose->last_report_ms < FONT_CACHE_STATS_INTERVAL_MS)
+		return;
+
+	LOG(DEBUG, "font: composition cache %llu hits, %llu misses (%.1f%% hit rate)",
+	    (unsigned long long)compose->hits,
+	    (unsigned long long)compose->misses,
+	    compose->hits * 100.0 / lookups);
+	compose->hits = 0;
+	compose->misses = 0;
+	compose->last_report_ms = now_ms;
+}
+
+static void font_cache_invalidate(font_cache_t* cache)
+{
+	for (int i = 0; i < FONT_CACHE_BUCKETS; i++)
+		cache->buckets[i] = -1;
+
+	for (int i = 0; i < FONT_CACHE_ENTRIES; i++) {
+		font_cache_entry_t* entry = &cache->entries[i];
+		entry->glyph_index = -1;
+		entry->hash_next = -1;
+		entry->lru_prev = i - 1;
+		entry->lru_next = i + 1 < FONT_CACHE_ENTRIES ? i + 1 : -1;
+	}
+	cache->lru_head = 0;
+	cache->lru_tail = FONT_CACHE_ENTRIES - 1;
+}
+
+/*
+ * Tiles are only kept while the font is referenced, they are cheap to
+ * recreate compared to scaled glyphs.
+ */
+static void font_cache_init(font_t* font)
+{
+	font_cache_t* cache = &font->cache;
+	uint32_t width, height;
+
+	rotated_cell_size(font, &width, &height);
+	cache->tile_pixels = width * height;
+	cache->tiles = (uint32_t*)malloc(FONT_CACHE_ENTRIES *
+			cache->tile_pixels * sizeof(uint32_t));
+	if (!cache->tiles)
+		LOG(WARNING, "Failed to allocate glyph cache.");
+	cache->last_report_ms = get_monotonic_time_ms();
+	font_cache_invalidate(cache);
+}
+
+static void font_cache_free(font_cache_t* cache)
+{
+	font_cache_report_stats(cache, true);
+	free(cache->tiles);
+	cache->tiles = NULL;
+}
+
+static uint32_t font_cache_hash(int32_t glyph_index, uint32_t front_color,
+				uint32_t back_color)
+{
+	uint32_t hash = glyph_index * 0x9e3779b1u;
+
+	hash ^= front_color * 0x85ebca6bu;
+	hash ^= back_color * 0xc2b2ae35u;
+	return (hash ^ (hash >> 16)) & (FONT_CACHE_BUCKETS - 1);
+}
+
+static void font_cache_lru_unlink(font_cache_t* cache, int32_t i)
+{
+	font_cache_entry_t* entry = &cache->entries[i];
+
+	if (entry->lru_prev >= 0)
+		cache->entries[entry->lru_prev].lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+	if (entry->lru_next >= 0)
+		cache->entries[entry->lru_next].lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+}
+
+static void font_cache_lru_push(font_cache_t* cache, int32_t i)
+{
+	font_cache_entry_t* entry = &cache->entries[i];
+
+	entry->lru_prev = -1;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head >= 0)
+		cache->entries[cache->lru_head].lru_prev = i;
+	else
+		cache->lru_tail = i;
+	cache->lru_head = i;
+}
+
+/*
+ * Look up expanded tile for the glyph and colors. On a miss the least
+ * recently used entry is taken over and |hit| is set to false, the caller
+ * has to fill in the returned tile. Returns NULL if the cache is disabled.
+ */
+static uint32_t* font_cache_lookup(font_cache_t* cache, int32_t glyph_index,
+				   uint32_t front_color, uint32_t back_color,
+				   bool* hit)
+{
+	uint32_t bucket;
+	int32_t i, *link;
+
+	if (!cache->tiles)
+		return NULL;
+
+	bucket = font_cache_hash(glyph_index, front_color, back_color);
+	for (i = cache->buckets[bucket]; i >= 0;
+	     i = cache->entries[i].hash_next) {
+		font_cache_entry_t* entry = &cache->entries[i];
+		if (entry->glyph_index == glyph_index &&
+		    entry->front_color == front_color &&
+		    entry->back_color == back_color)
+			break;
+	}
+
+	*hit = i >= 0;
+	if (*hit) {
+		cache->hits++;
+	} else {
+		font_cache_entry_t* entry;
+
+		cache->misses++;
+		i = cache->lru_tail;
+		entry = &cache->entries[i];
+		if (entry->glyph_index >= 0) {
+			uint32_t old_bucket = font_cache_hash(entry->glyph_index,
+							      entry->front_color,
+							      entry->back_color);
+			for (link = &cache->buckets[old_bucket]; *link != i;
+			     link = &cache->entries[*link].hash_next)
+				;
+			*link = entry->hash_next;
+		}
+		entry->glyph_index = glyph_index;
+		entry->front_color = front_color;
+		entry->back_color = back_color;
+		entry->hash_next = cache->buckets[bucket];
+		cache->buckets[bucket] = i;
+	}
+
+	if (cache->lru_head != i) {
+		font_cache_lru_unlink(cache, i);
+		font_cache_lru_push(cache, i);
+	}
+
+	if (((cache->hits + cache->misses) & 1023) == 0)
+		font_cache_report_stats(cache, false);
+
+	return &cache->tiles[i * cache->tile_pixels];
+}
+
+static uint32_t font_compose_hash(const uint32_t* ch, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ ch[i]) * 16777619u;
+	return hash;
+}
+
+/*
+ * Returns the bitmap of the base glyph with all combining marks in |ch|
+ * drawn over it and its glyph index in |glyph_index|, or NULL on failure.
+ */
+static const uint8_t* font_compose_glyph(font_t* font, const uint32_t* ch,
+					 size_t len, int32_t* glyph_index)
+{
+	font_compose_t* compose = &font->compose;
+	font_compose_entry_t* entry = NULL;
+	uint32_t hash;
+	uint8_t* dst;
+	int i, victim = 0;
+
+	if (len > FONT_COMPOSE_MAX_CHARS)
+		len = FONT_COMPOSE_MAX_CHARS;
+	hash = font_compose_hash(ch, len);
+
+	for (i = 0; i < FONT_COMPOSE_ENTRIES; i++) {
+		font_compose_entry_t* e = &compose->entries[i];
+		if (e->len == len && e->hash == hash &&
+		    !memcmp(e->code_points, ch, len * sizeof(*ch))) {
+			entry = e;
+			break;
+		}
+		if (compose->entries[victim].len &&
+		    (!e->len || e->last_use < compose->entries[victim].last_use))
+			victim = i;
+	}
+
+	if (((compose->hits + compose->misses) & 255) == 0)
+		font_compose_report_stats(compose, false);
+
+	if (entry) {
+		compose->hits++;
+		entry->last_use = ++compose->uses;
+		*glyph_index = entry->glyph_index;
+		return &compose->bitmaps[i * font->glyph_size];
+	}
+	compose->misses++;
+
+	if (!compose->bitmaps) {
+		compose->bitmaps = (uint8_t*)malloc(FONT_COMPOSE_ENTRIES *
+						    font->glyph_size);
+		if (!compose->bitmaps) {
+			LOG(WARNING, "Failed to allocate composition cache.");
+			return NULL;
+		}
+	}
+
+	/* Out of fresh indices, start over with all caches empty. */
+	if (compose->next_index >= INT32_MAX - (int32_t)font->source->count) {
+		compose->next_index = 0;
+		for (i = 0; i < FONT_COMPOSE_ENTRIES; i++)
+			compose->entries[i].len = 0;
+		font_cache_invalidate(&font->cache);
+	}
+
+	entry = &compose->entries[victim];
+	dst = &compose->bitmaps[victim * font->glyph_size];
+	memset(dst, 0, font->glyph_size);
+	for (size_t c = 0; c < len; c++) {
+		int32_t index = font->source->lookup(ch[c]);
+		const uint8_t* glyph;
+
+		if (index < 0 && c == 0)
+			index = font->source->lookup(
+				UNICODE_REPLACEMENT_CHARACTER_CODE_POINT);
+		if (index < 0)
+			continue;
+		glyph = font_get_glyph(font, index);
+		if (!glyph)
+			continue;
+		for (int b = 0; b < font->glyph_size; b++)
+			dst[b] |= glyph[b];
+	}
+
+	memcpy(entry->code_points, ch, len * sizeof(*ch));
+	entry->len = len;
+	entry->hash = hash;
+	entry->glyph_index = font->source->count + compose->next_index++;
+	entry->last_use = ++compose->uses;
+	*glyph_index = entry->glyph_index;
+	return dst;
+}
+
+static void font_destroy(font_t* font)
+{
+	font_t** link;
+
+	for (link = &fonts; *link != font; link = &(*link)->next)
+		;
+	*link = font->next;
+	font_glyphs_free(font);
+	font_cache_free(&font->cache);
+	free(font);
+}
+
+/* Drop unreferenced fonts beyond FONT_MAX_IDLE, oldest first. */
+static void font_evict_idle(void)
+{
+	for (;;) {
+		font_t* oldest = NULL;
+		int idle = 0;
+
+		for (font_t* font = fonts; font; font = font->next) {
+			if (font->ref)
+				continue;
+			idle++;
+			if (!oldest || font->release_ms < oldest->release_ms)
+				oldest = font;
+		}
+		if (idle <= FONT_MAX_IDLE)
+			return;
+		font_destroy(oldest);
+	}
+}
+
+static int32_t file_source_lookup(uint32_t code_point)
+{
+	uint32_t lo = 0, hi = file_map_count;
+
+	if (!file_map)
+		return code_point < file_source.count ? (int32_t)code_point : -1;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (file_map[mid].code_point == code_point)
+			return file_map[mid].glyph_index;
+		if (file_map[mid].code_point < code_point)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return -1;
+}
+
+/* Decodes one UTF-8 sequence, returns its length or 0 if invalid. */
+static int utf8_decode(const uint8_t* p, const uint8_t* end, uint32_t* cp)
+{
+	int len;
+
+	if (p[0] < 0x80) {
+		*cp = p[0];
+		return 1;
+	} else if ((p[0] & 0xe0) == 0xc0) {
+		*cp = p[0] & 0x1f;
+		len = 2;
+	} else if ((p[0] & 0xf0) == 0xe0) {
+		*cp = p[0] & 0x0f;
+		len = 3;
+	} else if ((p[0] & 0xf8) == 0xf0) {
+		*cp = p[0] & 0x07;
+		len = 4;
+	} else {
+		return 0;
+	}
+
+	if (end - p < len)
+		return 0;
+	for (int i = 1; i < len; i++) {
+		if ((p[i] & 0xc0) != 0x80)
+			return 0;
+		*cp = (*cp << 6) | (p[i] & 0x3f);
+	}
+	return len;
+}
+
+static int font_map_compare(const void* a, const void* b)
+{
+	const font_map_entry_t* ea = (const font_map_entry_t*)a;
+	const font_map_entry_t* eb = (const font_map_entry_t*)b;
+
+	if (ea->code_point != eb->code_point)
+		return ea->code_point < eb->code_point ? -1 : 1;
+	return ea->glyph_index < eb->glyph_index ? -1 :
+	       ea->glyph_index > eb->glyph_index;
+}
+
+/*
+ * Builds the sorted code point map from the PSF2 unicode table. Each glyph
+ * lists the code points it represents, then optional sequences starting with
+ * PSF2_STARTSEQ, terminated by PSF2_SEPARATOR. Sequences are not used.
+ */
+static int font_parse_unicode_table(const uint8_t* p, const uint8_t* end,
+				    uint32_t glyph_count)
+{
+	uint32_t capacity = 0;
+
+	for (int pass = 0; pass < 2; pass++) {
+		const uint8_t* q = p;
+		uint32_t glyph = 0;
+		bool in_sequence = false;
+
+		if (pass == 1) {
+			file_map = (font_map_entry_t*)calloc(capacity,
+							     sizeof(*file_map));
+			if (!file_map)
+				return -ENOMEM;
+		}
+		file_map_count = 0;
+
+		while (q < end && glyph < glyph_count) {
+			uint32_t cp;
+			int len;
+
+			if (*q == PSF2_SEPARATOR) {
+				in_sequence = false;
+				glyph++;
+				q++;
+				continue;
+			}
+			if (*q == PSF2_STARTSEQ) {
+				in_sequence = true;
+				q++;
+				continue;
+			}
+
+			len = utf8_decode(q, end, &cp);
+			if (!len)
+				return -EINVAL;
+			q += len;
+			if (in_sequence)
+				continue;
+			if (pass == 1) {
+				file_map[file_map_count].code_point = cp;
+				file_map[file_map_count].glyph_index = glyph;
+			}
+			file_map_count++;
+		}
+		capacity = file_map_count;
+	}
+
+	qsort(file_map, file_map_count, sizeof(*file_map), font_map_compare);
+	return 0;
+}
+
+int font_load(const char* path)
 {
-	int glyph_count = sizeof(glyphs) / (GLYPH_BYTES_PER_ROW * GLYPH_HEIGHT);
+	const psf2_header_t* header;
+	uint8_t* data;
+	struct stat st;
+	uint32_t bytes_per_row;
+	uint64_t bitmaps_end;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOG(ERROR, "Failed to open font %s: %m.", path);
+		return -errno;
+	}
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	if ((size_t)st.st_size < sizeof(*header)) {
+		LOG(ERROR, "Font %s is too small.", path);
+		close(fd);
+		return -EINVAL;
+	}
 
-	glyph_size = GLYPH_BYTES_PER_ROW * GLYPH_HEIGHT * scaling * scaling;
-	if (!prescaled_glyphs)
-		prescaled_glyphs = (uint8_t*)calloc(glyph_count, glyph_size);
-	for (int i = 0; i < glyph_count; i++) {
-		const uint8_t* src_glyph = glyphs[i];
-		uint8_t* dst_glyph = &prescaled_glyphs[i * glyph_size];
-		scale_glyph(dst_glyph, src_glyph, scaling);
+	/* Bitmaps are used in place, only the code point map is copied. */
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	ret = -errno;
+	close(fd);
+	if (data == MAP_FAILED) {
+		LOG(ERROR, "Failed to map font %s.", path);
+		return ret;
+	}
+
+	header = (const psf2_header_t*)data;
+	bytes_per_row = (header->width + 7) / 8;
+	bitmaps_end = (uint64_t)header->header_size +
+		      (uint64_t)header->length * header->char_size;
+	if (header->magic != PSF2_MAGIC ||
+	    header->header_size < sizeof(*header) ||
+	    header->length == 0 || header->width == 0 || header->height == 0 ||
+	    header->char_size != bytes_per_row * header->height ||
+	    bitmaps_end > (uint64_t)st.st_size) {
+		LOG(ERROR, "Font %s is not a valid PSF2 font.", path);
+		munmap(data, st.st_size);
+		return -EINVAL;
+	}
+	if (header->width * header->height > FONT_MAX_CELL_PIXELS ||
+	    header->char_size > FONT_MAX_GLYPH_BYTES) {
+		LOG(ERROR, "Font %s glyphs are too large (%ux%u).", path,
+		    header->width, header->height);
+		munmap(data, st.st_size);
+		return -EINVAL;
+	}
+
+	if (header->flags & PSF2_HAS_UNICODE_TABLE) {
+		ret = font_parse_unicode_table(&data[bitmaps_end],
+					       &data[st.st_size],
+					       header->length);
+		if (ret < 0) {
+			LOG(ERROR, "Font %s has a bad unicode table.", path);
+			free(file_map);
+			file_map = NULL;
+			munmap(data, st.st_size);
+			return ret;
+		}
 	}
+
+	file_source.width = header->width;
+	file_source.height = header->height;
+	file_source.bytes_per_row = bytes_per_row;
+	file_source.glyph_size = header->char_size;
+	file_source.count = header->length;
+	file_source.bitmaps = &data[header->header_size];
+	file_source.lookup = file_source_lookup;
+
+	LOG(INFO, "Loaded font %s, %u glyphs of %ux%u.", path,
+	    file_source.count, file_source.width, file_source.height);
+	return 0;
 }
 
-void font_init(int scaling)
+int font_load_fallback(const char* path)
 {
-	if (font_ref == 0) {
-		font_scaling = scaling;
-		if (scaling > 1) {
-			prescale_font(scaling);
+	const font_paged_header_t* header;
+	struct stat st;
+	uint8_t* data;
+	uint64_t directory_end;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOG(ERROR, "Failed to open fallback font %s: %m.", path);
+		return -errno;
+	}
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	if ((size_t)st.st_size < sizeof(*header)) {
+		LOG(ERROR, "Fallback font %s is too small.", path);
+		close(fd);
+		return -EINVAL;
+	}
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	ret = -errno;
+	close(fd);
+	if (data == MAP_FAILED) {
+		LOG(ERROR, "Failed to map fallback font %s.", path);
+		return ret;
+	}
+	/* Only the pages in use should be read in. */
+	madvise(data, st.st_size, MADV_RANDOM);
+
+	header = (const font_paged_header_t*)data;
+	directory_end = sizeof(*header) + (uint64_t)header->page_count *
+					  sizeof(uint32_t);
+	if (header->magic != FONT_PAGED_MAGIC ||
+	    header->version != FONT_PAGED_VERSION ||
+	    header->cell_width == 0 || header->height == 0 ||
+	    header->bytes_per_row * 8 < 2 * header->cell_width ||
+	    header->glyph_size != header->bytes_per_row * header->height ||
+	    directory_end > (uint64_t)st.st_size) {
+		LOG(ERROR, "Fallback font %s is not a valid paged font.", path);
+		munmap(data, st.st_size);
+		return -EINVAL;
+	}
+
+	fallback.resident = (uint8_t*)calloc(header->page_count, 1);
+	if (!fallback.resident) {
+		munmap(data, st.st_size);
+		return -ENOMEM;
+	}
+	fallback.data = data;
+	fallback.size = st.st_size;
+	fallback.header = header;
+	fallback.directory = (const uint32_t*)&data[sizeof(*header)];
+	fallback.resident_count = 0;
+
+	LOG(INFO, "Loaded fallback font %s, %u pages of %ux%u glyphs.", path,
+	    header->page_count, header->cell_width, header->height);
+	return 0;
+}
+
+/*
+ * Returns the fallback bitmap for |code_point| and its width in cells, or
+ * NULL if there is none. The page holding it is paged in on first use.
+ */
+static const uint8_t* fallback_get_glyph(uint32_t code_point, uint32_t* cells)
+{
+	const font_paged_header_t* header = fallback.header;
+	uint32_t page = code_point >> FONT_PAGED_SHIFT;
+	uint32_t index = code_point & (FONT_PAGED_SIZE - 1);
+	uint64_t page_bytes;
+	const uint8_t* page_data;
+
+	if (!header || page >= header->page_count || !fallback.directory[page])
+		return NULL;
+
+	page_bytes = FONT_PAGED_SIZE +
+		     (uint64_t)FONT_PAGED_SIZE * header->glyph_size;
+	if (fallback.directory[page] + page_bytes > fallback.size)
+		return NULL;
+	page_data = &fallback.data[fallback.directory[page]];
+
+	if (!fallback.resident[page]) {
+		long page_size = sysconf(_SC_PAGESIZE);
+		uintptr_t start = (uintptr_t)page_data & ~(page_size - 1);
+
+		madvise((void*)start,
+			(uintptr_t)page_data + page_bytes - start,
+			MADV_WILLNEED);
+		fallback.resident[page] = 1;
+		fallback.resident_count++;
+		LOG(DEBUG, "font: fallback page U+%04X in use, %u of %u pages resident (%llu KB)",
+		    page << FONT_PAGED_SHIFT,
+		    fallback.resident_count, header->page_count,
+		    (unsigned long long)(fallback.resident_count *
+					 page_bytes / 1024));
+	}
+
+	*cells = page_data[index];
+	if (*cells == 0 || *cells > 2)
+		return NULL;
+	return &page_data[FONT_PAGED_SIZE + index * header->glyph_size];
+}
+
+/*
+ * Picks the loaded font scaled by the whole factor closest to the height of
+ * the built-in font at |scaling|, as long as the scaled glyphs fit in the
+ * cell limits. If the loaded font is too tall even unscaled, the built-in
+ * font is used at this scale.
+ */
+static void font_select_source(font_t* font)
+{
+	font->source = &builtin_source;
+	font->glyph_scaling = font->scaling;
+
+	if (file_source.bitmaps) {
+		int glyph_scaling = (GLYPH_HEIGHT * font->scaling +
+				     file_source.height / 2) /
+				    file_source.height;
+		if (glyph_scaling >= 1 &&
+		    glyph_scaling <= FONT_MAX_SCALING &&
+		    file_source.width * file_source.height *
+		    glyph_scaling * glyph_scaling <= FONT_MAX_CELL_PIXELS &&
+		    file_source.glyph_size *
+		    glyph_scaling * glyph_scaling <= FONT_MAX_GLYPH_BYTES) {
+			font->source = &file_source;
+			font->glyph_scaling = glyph_scaling;
 		}
 	}
-	font_ref++;
 }
 
-void font_free()
+font_t* font_init(int scaling, int32_t rotation)
 {
-	font_ref--;
-	if (font_ref == 0) {
-		if (prescaled_glyphs) {
-			free(prescaled_glyphs);
-			prescaled_glyphs = NULL;
+	font_t* font;
+
+	if (scaling < 1 || scaling > FONT_MAX_SCALING) {
+		LOG(ERROR, "Unsupported font scaling %d.", scaling);
+		return NULL;
+	}
+
+	for (font = fonts; font; font = font->next)
+		if (font->scaling == scaling && font->rotation == rotation)
+			break;
+
+	if (!font) {
+		font = (font_t*)calloc(1, sizeof(*font));
+		if (!font)
+			return NULL;
+		font->scaling = scaling;
+		font->rotation = rotation;
+		font_select_source(font);
+		if (font_glyphs_init(font) < 0) {
+			font_glyphs_free(font);
+			free(font);
+			return NULL;
 		}
+		init_expand_masks();
+		font->next = fonts;
+		fonts = font;
 	}
+
+	if (font->ref == 0)
+		font_cache_init(font);
+	font->ref++;
+	return font;
 }
 
-void font_get_size(uint32_t* char_width, uint32_t* char_height)
+void font_free(font_t* font)
 {
-	*char_width = GLYPH_WIDTH * font_scaling;
-	*char_height = GLYPH_HEIGHT * font_scaling;
+	if (!font)
+		return;
+
+	font->ref--;
+	if (font->ref == 0) {
+		font_cache_free(&font->cache);
+		font_compose_report_stats(&font->compose, true);
+		font->release_ms = get_monotonic_time_ms();
+		font_evict_idle();
+	}
+}
+
+void font_get_size(font_t* font, uint32_t* char_width, uint32_t* char_height)
+{
+	*char_width = font->source->width * font->glyph_scaling;
+	*char_height = font->source->height * font->glyph_scaling;
 }
 
 
-int font_get_scaling()
+int font_get_scaling(font_t* font)
 {
-	return font_scaling;
+	return font->scaling;
 }
 
-void font_fillchar(fb_t *fb, int dst_char_x, int dst_char_y,
+void font_fillchar(font_t* font, fb_t *fb, int dst_char_x, int dst_char_y,
 		   uint32_t front_color, uint32_t back_color)
 {
-	fb_stepper_t s;
+	font_fillchars(font, fb, dst_char_x, dst_char_y, 1, back_color);
+}
 
-	fb_stepper_init(&s,
-			fb,
-			dst_char_x * GLYPH_WIDTH * font_scaling,
-			dst_char_y * GLYPH_HEIGHT * font_scaling,
-			GLYPH_WIDTH * font_scaling,
-			GLYPH_HEIGHT * font_scaling);
+void font_fillchars(font_t* font, fb_t *fb, int dst_char_x, int dst_char_y,
+		    uint32_t count, uint32_t back_color)
+{
+	uint32_t cell_width, cell_height;
 
-	do {
-		do {
-		} while (fb_stepper_step_x(&s, back_color));
-	} while (fb_stepper_step_y(&s));
+	font_get_size(font, &cell_width, &cell_height);
+	fb_fill_rect(fb,
+		     dst_char_x * cell_width,
+		     dst_char_y * cell_height,
+		     count * cell_width, cell_height,
+		     back_color);
 }
 
-void font_render(fb_t *fb, int dst_char_x, int dst_char_y,
-		 uint32_t ch, uint32_t front_color,
+/* Expand glyph bitmap to a tile of pixels in framebuffer orientation. */
+static void font_expand_glyph(font_t* font, uint32_t* dst, const uint8_t* glyph,
+			      uint32_t front_color, uint32_t back_color)
+{
+	uint32_t tile_width, tile_height;
+
+	rotated_cell_size(font, &tile_width, &tile_height);
+	for (uint32_t y = 0; y < tile_height; y++) {
+		expand_row(dst, &glyph[y * font->glyph_bytes_per_row],
+			   tile_width, front_color, back_color);
+		dst += tile_width;
+	}
+}
+
+/*
+ * Draws |code_point| from the fallback font over |cells| cells in a single
+ * blit. The glyph keeps the width the font file gives it, clipped to |cells|,
+ * and a narrow glyph in a wide cell gets the second cell blanked. Fallback
+ * glyphs are rare, so they are not kept in the tile cache.
+ * Returns false if there is no fallback glyph or the fallback font does not
+ * fit the cells of |font|.
+ */
+static bool font_render_fallback(font_t* font, fb_t* fb, int dst_char_x,
+				 int dst_char_y, uint32_t code_point,
+				 uint32_t cells, uint32_t front_color,
+				 uint32_t back_color)
+{
+	const font_paged_header_t* header = fallback.header;
+	uint8_t scaled[FONT_MAX_WIDE_BYTES];
+	uint8_t rotated[FONT_MAX_WIDE_BYTES];
+	uint32_t tile[FONT_MAX_WIDE_PIXELS];
+	uint32_t cell_width, cell_height, glyph_cells, draw_cells;
+	uint32_t width, tile_width, tile_height, bytes_per_row;
+	const uint8_t* glyph;
+	int scaling;
+
+	if (!header)
+		return false;
+
+	font_get_size(font, &cell_width, &cell_height);
+	if (cell_height % header->height)
+		return false;
+	scaling = cell_height / header->height;
+	if (scaling > FONT_MAX_SCALING ||
+	    header->cell_width * scaling != cell_width)
+		return false;
+
+	glyph = fallback_get_glyph(code_point, &glyph_cells);
+	if (!glyph)
+		return false;
+
+	cells = cells > 1 ? 2 : 1;
+	draw_cells = MIN(glyph_cells, cells);
+	width = draw_cells * cell_width;
+	bytes_per_row = header->bytes_per_row * scaling;
+	if (bytes_per_row * cell_height > sizeof(scaled))
+		return false;
+
+	if (scaling > 1) {
+		font_source_t source = {
+			.width = glyph_cells * header->cell_width,
+			.height = header->height,
+			.bytes_per_row = header->bytes_per_row,
+		};
+
+		memset(scaled, 0, bytes_per_row * cell_height);
+		scale_glyph(&source, scaled, glyph, scaling);
+		glyph = scaled;
+	}
+
+	if (font->rotation == DRM_MODE_ROTATE_90 ||
+	    font->rotation == DRM_MODE_ROTATE_270) {
+		tile_width = cell_height;
+		tile_height = width;
+	} else {
+		tile_width = width;
+		tile_height = cell_height;
+	}
+
+	if (font->rotation != DRM_MODE_ROTATE_0) {
+		uint32_t rotated_bytes_per_row = (tile_width + 7) / 8;
+
+		if (rotated_bytes_per_row * tile_height > sizeof(rotated))
+			return false;
+		memset(rotated, 0, rotated_bytes_per_row * tile_height);
+		rotate_bitmap(font->rotation, rotated, rotated_bytes_per_row,
+			      glyph, bytes_per_row, width, cell_height);
+		glyph = rotated;
+		bytes_per_row = rotated_bytes_per_row;
+	}
+
+	if (tile_width * tile_height > ARRAY_SIZE(tile))
+		return false;
+	for (uint32_t y = 0; y < tile_height; y++)
+		expand_row(&tile[y * tile_width], &glyph[y * bytes_per_row],
+			   tile_width, front_color, back_color);
+
+	if (font->rotation != DRM_MODE_ROTATE_0)
+		fb_copy_rect_prerotated(fb,
+					dst_char_x * cell_width,
+					dst_char_y * cell_height,
+					width, cell_height,
+					tile, tile_width);
+	else
+		fb_copy_rect(fb,
+			     dst_char_x * cell_width,
+			     dst_char_y * cell_height,
+			     width, cell_height,
+			     tile, tile_width);
+
+	if (draw_cells < cells)
+		font_fillchar(font, fb, dst_char_x + 1, dst_char_y,
+			      front_color, back_color);
+	return true;
+}
+
+/* Copies an expanded tile to the cell. */
+static void font_copy_tile(font_t* font, fb_t* fb, int dst_char_x,
+			   int dst_char_y, const uint32_t* tile)
+{
+	uint32_t cell_width, cell_height;
+	uint32_t tile_width, tile_height;
+
+	font_get_size(font, &cell_width, &cell_height);
+	rotated_cell_size(font, &tile_width, &tile_height);
+	if (font->rotation != DRM_MODE_ROTATE_0)
+		fb_copy_rect_prerotated(fb,
+					dst_char_x * cell_width,
+					dst_char_y * cell_height,
+					cell_width, cell_height,
+					tile, tile_width);
+	else
+		fb_copy_rect(fb,
+			     dst_char_x * cell_width,
+			     dst_char_y * cell_height,
+			     cell_width, cell_height,
+			     tile, tile_width);
+}
+
+/* Writes a prepared glyph bitmap to the cell, through the tile cache. */
+static void font_draw_glyph(font_t* font, fb_t* fb, int dst_char_x,
+			    int dst_char_y, int32_t glyph_index,
+			    const uint8_t* glyph, uint32_t front_color,
+			    uint32_t back_color)
+{
+	uint32_t cell[FONT_MAX_CELL_PIXELS];
+	uint32_t* tile;
+	bool hit = false;
+
+	tile = font_cache_lookup(&font->cache, glyph_index,
+				 front_color, back_color, &hit);
+	if (!tile)
+		tile = cell;
+	if (!hit)
+		font_expand_glyph(font, tile, glyph, front_color, back_color);
+
+	font_copy_tile(font, fb, dst_char_x, dst_char_y, tile);
+}
+
+const uint8_t* font_get_bitmap(font_t* font, uint32_t ch)
+{
+	int32_t glyph_index = font->source->lookup(ch);
+
+	if (glyph_index < 0)
+		return NULL;
+	return font_get_glyph(font, glyph_index);
+}
+
+void font_draw_bitmap(font_t* font, fb_t* fb, int dst_char_x, int dst_char_y,
+		      const uint8_t* bitmap, uint32_t front_color,
+		      uint32_t back_color)
+{
+	uint32_t tile[FONT_MAX_CELL_PIXELS];
+
+	font_expand_glyph(font, tile, bitmap, front_color, back_color);
+	font_copy_tile(font, fb, dst_char_x, dst_char_y, tile);
+}
+
+void font_render(font_t* font, fb_t *fb, int dst_char_x, int dst_char_y,
+		 uint32_t ch, uint32_t cwidth, uint32_t front_color,
 		 uint32_t back_color)
 {
-	int32_t glyph_index = code_point_to_glyph_index(ch);
-	fb_stepper_t s;
+	int32_t glyph_index = font->source->lookup(ch);
+	const uint8_t* glyph;
 
 	if (glyph_index < 0) {
-		glyph_index = code_point_to_glyph_index(
+		if (font_render_fallback(font, fb, dst_char_x, dst_char_y, ch,
+					 cwidth, front_color, back_color))
+			return;
+		glyph_index = font->source->lookup(
 			UNICODE_REPLACEMENT_CHARACTER_CODE_POINT);
 		if (glyph_index < 0) {
 			return;
 		}
 	}
 
-	fb_stepper_init(&s,
-			fb,
-			dst_char_x * GLYPH_WIDTH * font_scaling,
-			dst_char_y * GLYPH_HEIGHT * font_scaling,
-			GLYPH_WIDTH * font_scaling,
-			GLYPH_HEIGHT * font_scaling);
+	glyph = font_get_glyph(font, glyph_index);
+	if (!glyph)
+		return;
 
-	const uint8_t* glyph;
-	if (font_scaling == 1) {
-		glyph = glyphs[glyph_index];
-	} else {
-		glyph = &prescaled_glyphs[glyph_index * glyph_size];
+	font_draw_glyph(font, fb, dst_char_x, dst_char_y, glyph_index, glyph,
+			front_color, back_color);
+
+	/* Glyphs of the main font are a single cell, blank the rest. */
+	if (cwidth > 1)
+		font_fillchar(font, fb, dst_char_x + 1, dst_char_y,
+			      front_color, back_color);
+}
+
+void font_render_composed(font_t* font, fb_t *fb, int dst_char_x,
+			  int dst_char_y, const uint32_t* ch, size_t len,
+			  uint32_t cwidth, uint32_t front_color,
+			  uint32_t back_color)
+{
+	int32_t glyph_index;
+	const uint8_t* glyph = NULL;
+
+	/* Marks are only composed onto glyphs of the main font. */
+	if (len > 1 && font->source->lookup(ch[0]) >= 0)
+		glyph = font_compose_glyph(font, ch, len, &glyph_index);
+	if (!glyph) {
+		font_render(font, fb, dst_char_x, dst_char_y, ch[0], cwidth,
+			    front_color, back_color);
+		return;
 	}
 
-	do {
-		const uint8_t* src_row =
-			&glyph[s.y * GLYPH_BYTES_PER_ROW * font_scaling];
-		do {
-		} while (fb_stepper_step_x(&s, get_bit(src_row, s.x) ? front_color : back_color));
-	} while (fb_stepper_step_y(&s));
+	font_draw_glyph(font, fb, dst_char_x, dst_char_y, glyph_index, glyph,
+			front_color, back_color);
+	if (cwidth > 1)
+		font_fillchar(font, fb, dst_char_x + 1, dst_char_y,
+			      front_color, back_color);
 }
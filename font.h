@@ -9,14 +9,41 @@
 
 #include "fb.h"
 
-void font_init(int scaling);
-void font_free();
-void font_fillchar(fb_t *fb, int dst_char_x, int dst_char_y,
+#define FONT_MAX_SCALING 4
+
+/* Glyph set for one scale factor, shared by all terminals using it. */
+typedef struct _font_t font_t;
+
+/* Load a PSF2 font to use instead of the built-in one, before font_init(). */
+int font_load(const char* path);
+/* Load a paged font (font_to_c.py --paged) for code points missing above. */
+int font_load_fallback(const char* path);
+font_t* font_init(int scaling, int32_t rotation);
+void font_free(font_t* font);
+void font_fillchar(font_t* font, fb_t *fb, int dst_char_x, int dst_char_y,
 		   uint32_t front_color, uint32_t back_color);
-void font_render(fb_t *fb, int dst_char_x, int dst_char_y,
-		 uint32_t ch, uint32_t front_color,
+/* Fill |count| cells of a row starting at the given one with |back_color|. */
+void font_fillchars(font_t* font, fb_t *fb, int dst_char_x, int dst_char_y,
+		    uint32_t count, uint32_t back_color);
+void font_render(font_t* font, fb_t *fb, int dst_char_x, int dst_char_y,
+		 uint32_t ch, uint32_t cwidth, uint32_t front_color,
 		 uint32_t back_color);
-void font_get_size(uint32_t* char_width, uint32_t* char_height);
-int font_get_scaling();
+/* Render a base character followed by |len| - 1 combining characters. */
+void font_render_composed(font_t* font, fb_t *fb, int dst_char_x,
+			  int dst_char_y, const uint32_t* ch, size_t len,
+			  uint32_t cwidth, uint32_t front_color,
+			  uint32_t back_color);
+/*
+ * Drawing from render threads: font_get_bitmap() looks up a character of the
+ * font on the main thread, NULL if font_render() has to draw it. The bitmap
+ * stays valid as long as |font| and font_draw_bitmap() draws it without
+ * touching any state shared with other threads.
+ */
+const uint8_t* font_get_bitmap(font_t* font, uint32_t ch);
+void font_draw_bitmap(font_t* font, fb_t* fb, int dst_char_x, int dst_char_y,
+		      const uint8_t* bitmap, uint32_t front_color,
+		      uint32_t back_color);
+void font_get_size(font_t* font, uint32_t* char_width, uint32_t* char_height);
+int font_get_scaling(font_t* font);
 
 #endif
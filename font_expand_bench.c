@@ -0,0 +1,103 @@
+/*
+ * Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Times expand_row() against testing every bit with get_bit(), which is how
+ * glyph rows used to be expanded, and checks that both produce the same
+ * pixels. Rows are taken from the built-in glyph bitmaps.
+ */
+
+#include "font.c"
+
+#define BENCH_ROWS 1024
+#define BENCH_PASSES 2000
+#define BENCH_MAX_WIDTH 32
+#define BENCH_FRONT_COLOR 0xffaaaaaa
+#define BENCH_BACK_COLOR 0xff000000
+
+/* font.c draws through these, the benchmark never gets that far. */
+void fb_fill_rect(fb_t* fb, int32_t x, int32_t y, uint32_t width, uint32_t height,
+		  uint32_t rgba)
+{
+}
+
+void fb_copy_rect(fb_t* fb, int32_t x, int32_t y, uint32_t width, uint32_t height,
+		  const uint32_t* src, uint32_t src_pitch)
+{
+}
+
+void fb_copy_rect_prerotated(fb_t* fb, int32_t x, int32_t y,
+			     uint32_t width, uint32_t height,
+			     const uint32_t* src, uint32_t src_pitch)
+{
+}
+
+static uint32_t expected[BENCH_ROWS][BENCH_MAX_WIDTH];
+static uint32_t actual[BENCH_ROWS][BENCH_MAX_WIDTH];
+
+static void expand_row_bits(uint32_t* dst, const uint8_t* src, uint32_t width,
+			    uint32_t front_color, uint32_t back_color)
+{
+	for (uint32_t x = 0; x < width; x++)
+		dst[x] = get_bit(src, x) ? front_color : back_color;
+}
+
+/* Row |i| of a bench pass, |width| bits taken from the glyph bitmaps. */
+static const uint8_t* bench_row(int i, uint32_t width)
+{
+	const uint8_t* bitmaps = &glyphs[0][0];
+	size_t bytes_per_row = width / 8;
+
+	return &bitmaps[(i * bytes_per_row) %
+			(sizeof(glyphs) - bytes_per_row + 1)];
+}
+
+int main(void)
+{
+	int failures = 0;
+
+	init_expand_masks();
+	for (uint32_t width = 8; width <= BENCH_MAX_WIDTH; width += 8) {
+		int64_t start, bits_us, masks_us;
+
+		start = get_monotonic_time_us();
+		for (int pass = 0; pass < BENCH_PASSES; pass++)
+			for (int i = 0; i < BENCH_ROWS; i++)
+				expand_row_bits(expected[i], bench_row(i, width),
+						width, BENCH_FRONT_COLOR,
+						BENCH_BACK_COLOR);
+		bits_us = get_monotonic_time_us() - start;
+
+		start = get_monotonic_time_us();
+		for (int pass = 0; pass < BENCH_PASSES; pass++)
+			for (int i = 0; i < BENCH_ROWS; i++)
+				expand_row(actual[i], bench_row(i, width),
+					   width, BENCH_FRONT_COLOR,
+					   BENCH_BACK_COLOR);
+		masks_us = get_monotonic_time_us() - start;
+
+		for (int i = 0; i < BENCH_ROWS; i++) {
+			if (memcmp(expected[i], actual[i],
+				   width * sizeof(uint32_t))) {
+				fprintf(stderr, "row %d differs at width %u\n",
+					i, width);
+				failures++;
+			}
+		}
+
+		printf("width %2u: get_bit %6.2f ns/row, expand_row %6.2f ns/row (%.1fx)\n",
+		       width,
+		       bits_us * 1000.0 / (BENCH_PASSES * BENCH_ROWS),
+		       masks_us * 1000.0 / (BENCH_PASSES * BENCH_ROWS),
+		       masks_us ? (double)bits_us / masks_us : 0.0);
+	}
+
+	if (failures) {
+		fprintf(stderr, "%d expanded rows differ\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,12 @@
+/*
+ * Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * font_scale_test built against glyphs.h written by font_to_c --prescaled,
+ * see the Makefile, so the scaled glyphs are checked in every build.
+ */
+
+#include "font_scale_test.c"
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Checks that scale_glyph(), which goes through the pattern table built by
+ * build_scale_patterns(), matches evaluating scale_pixel() directly for every
+ * built-in glyph. When glyphs.h comes with glyphs scaled at build time, they
+ * have to match scale_glyph() as well.
+ */
+
+#include "font.c"
+
+/* font.c draws through these, the test never gets that far. */
+void fb_fill_rect(fb_t* fb, int32_t x, int32_t y, uint32_t width, uint32_t height,
+		  uint32_t rgba)
+{
+}
+
+void fb_copy_rect(fb_t* fb, int32_t x, int32_t y, uint32_t width, uint32_t height,
+		  const uint32_t* src, uint32_t src_pitch)
+{
+}
+
+void fb_copy_rect_prerotated(fb_t* fb, int32_t x, int32_t y,
+			     uint32_t width, uint32_t height,
+			     const uint32_t* src, uint32_t src_pitch)
+{
+}
+
+static void scale_glyph_reference(const font_source_t* source, uint8_t* dst,
+				  const uint8_t* src, int scaling)
+{
+	for (int y = 0; y < (int)source->height; y++) {
+		for (int x = 0; x < (int)source->width; x++) {
+			uint32_t neighbors = 0;
+			for (int dy = -1; dy <= 1; dy++) {
+				for (int dx = -1; dx <= 1; dx++) {
+					neighbors <<= 1;
+					neighbors |= glyph_pixel(source,
+						src, x + dx, y + dy);
+				}
+			}
+
+			for (int sy = 0; sy < scaling; sy++) {
+				uint8_t* dst_row = &dst[(y * scaling + sy) *
+					source->bytes_per_row * scaling];
+				for (int sx = 0; sx < scaling; sx++) {
+					if (scale_pixel(neighbors, sx, sy,
+							scaling))
+						set_bit(dst_row,
+							x * scaling + sx);
+				}
+			}
+		}
+	}
+}
+
+int main(void)
+{
+	const font_source_t* source = &builtin_source;
+	int failures = 0;
+
+	/* Scales alternate as with fonts of several scales in use at once. */
+	for (size_t i = 0; i < ARRAY_SIZE(glyphs); i++) {
+		for (int scaling = 2; scaling <= 4; scaling++) {
+			size_t size = source->glyph_size * scaling * scaling;
+			uint8_t expected[FONT_MAX_GLYPH_BYTES];
+			uint8_t actual[FONT_MAX_GLYPH_BYTES];
+
+			memset(expected, 0, size);
+			memset(actual, 0, size);
+			scale_glyph_reference(source, expected, glyphs[i],
+					      scaling);
+			scale_glyph(source, actual, glyphs[i], scaling);
+			if (memcmp(expected, actual, size)) {
+				fprintf(stderr, "glyph %zu differs at scale %d\n",
+					i, scaling);
+				failures++;
+			}
+#if defined(GLYPH_PRESCALED_MAX)
+			if (scaling <= GLYPH_PRESCALED_MAX) {
+				font_t font = {
+					.source = source,
+					.glyph_scaling = scaling,
+				};
+				const uint8_t* prescaled =
+					get_prescaled_glyph(&font, i);
+
+				if (!prescaled ||
+				    memcmp(prescaled, actual, size)) {
+					fprintf(stderr, "prescaled glyph %zu differs at scale %d\n",
+						i, scaling);
+					failures++;
+				}
+			}
+#endif
+		}
+	}
+
+	if (failures) {
+		fprintf(stderr, "%d scaled glyphs differ\n", failures);
+		return 1;
+	}
+	printf("all %zu glyphs match at scales 2 to 4\n", ARRAY_SIZE(glyphs));
+#if defined(GLYPH_PRESCALED_MAX)
+	printf("prescaled glyphs match up to scale %d\n", GLYPH_PRESCALED_MAX);
+#endif
+	return 0;
+}
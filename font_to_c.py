@@ -4,25 +4,80 @@
 # Use of this source code is governed by a BSD-style license that can be
 # found in the LICENSE file.
 
-"""Converts a font in bdf format into C source code."""
+"""Converts a font in bdf format into C source code.
+
+With --paged the font is written as a paged binary file instead, which frecon
+maps at runtime as a fallback for code points missing from the built-in font.
+"""
 
 from __future__ import print_function
 
 import re
+import struct
 import sys
 
 
+# Paged fallback font format, see font_load_fallback() in font.c.
+PAGED_MAGIC = 0x46505246  # 'FRPF'
+PAGED_VERSION = 1
+PAGED_HEADER_FORMAT = '<8I'
+PAGED_PAGE_SHIFT = 8
+PAGED_ALIGN = 4096
+
+
+# Neighbor bits passed to ScalePixel, same layout as scale_pixel() in font.c.
+NW, N, NE, W, C, E, SW, S, SE = [1 << b for b in range(8, -1, -1)]
+
+
+def ScalePixel(neighbors, sx, sy, scaling):
+  """Returns the sub-pixel (sx, sy) of a pixel scaled by |scaling|.
+
+  This must stay bit for bit identical to scale_pixel() in font.c, see there
+  for a description of the algorithm.
+  """
+  n = neighbors
+  last = scaling - 1
+  if n & C:
+    return not (
+        (sx == 0 and sy == 0 and
+         ((n & (S|SW|W|NW|N|NE)) == (S|NE) or
+          (n & (E|NE|N|NW|W|SW)) == (E|SW))) or
+        (sx == last and sy == 0 and
+         ((n & (W|NW|N|NE|E|SE)) == (W|SE) or
+          (n & (S|SE|E|NE|N|NW)) == (S|NW))) or
+        (sx == 0 and sy == last and
+         ((n & (N|NW|W|SW|S|SE)) == (N|SE) or
+          (n & (E|SE|S|SW|W|NW)) == (E|NW))) or
+        (sx == last and sy == last and
+         ((n & (N|NE|E|SE|S|SW)) == (N|SW) or
+          (n & (W|SW|S|SE|E|NE)) == (W|NE))))
+  return ((n & (N|W|E|S)) != (N|W|E|S) and
+          ((sx < sy and
+            (n & (W|S)) == (W|S) and
+            ((n & SW) == 0 or (n & (NW|SE)) == 0)) or
+           (sy < sx and
+            (n & (N|E)) == (N|E) and
+            ((n & NE) == 0 or (n & (NW|SE)) == 0)) or
+           (sx + sy > last and
+            (n & (E|S)) == (E|S) and
+            ((n & SE) == 0 or (n & (NE|SW)) == 0)) or
+           (sx + sy < last and
+            (n & (N|W)) == (N|W) and
+            ((n & NW) == 0 or (n & (NE|SW)) == 0))))
+
+
 class GlyphSet(object):
   """Collects glyph bitmap data and outputs it into C source code"""
   def __init__(self, width, height):
     self.glyph_map = {}
+    self.glyph_widths = {}
     self.width = width
     self.height = height
     self.bits_per_pixel = 1
     self.bytes_per_row = (self.bits_per_pixel * self.width + 7) // 8
     self.glyph_size = self.bytes_per_row * self.height
 
-  def AddGlyph(self, code_point, data):
+  def AddGlyph(self, code_point, data, width=None):
     """Adds a bitmap associated with the glyph identified by the code point.
 
     A glyph can be added at most once.
@@ -30,7 +85,8 @@ class GlyphSet(object):
     Args:
       code_point: a 32-bit unsigned integer identifying the code point of the
           glyph bitmap
-      data: an array of unsigned bytes with a length of exactly self.glyph_size
+      data: an array of unsigned bytes, self.height rows of |width| bits
+      width: the width of this glyph in pixels, self.width if not given
 
     Raises:
       Exception: the bitmap data is the wrong size or the code point was added
@@ -39,27 +95,65 @@ class GlyphSet(object):
     if code_point in self.glyph_map:
       raise Exception('code point %s already added' % code_point)
 
-    if len(data) != self.glyph_size:
+    if width is None:
+      width = self.width
+    glyph_size = (self.bits_per_pixel * width + 7) // 8 * self.height
+    if len(data) != glyph_size:
       raise Exception('given glyph is the wrong size, expected %s, got %s' %
-                      (self.glyph_size, len(data)))
+                      (glyph_size, len(data)))
 
     self.glyph_map[code_point] = data
-
-  def ToCSource(self, out_file):
+    self.glyph_widths[code_point] = width
+
+  def GetPixel(self, data, x, y):
+    """Returns the pixel at (x, y) of a glyph bitmap, 0 outside of it."""
+    if x < 0 or x >= self.width or y < 0 or y >= self.height:
+      return 0
+    return (data[y * self.bytes_per_row + x // 8] >> (7 - x % 8)) & 1
+
+  def ScaleGlyph(self, data, scaling):
+    """Returns the glyph bitmap scaled like scale_glyph() in font.c."""
+    bytes_per_row = self.bytes_per_row * scaling
+    out = [0] * (bytes_per_row * self.height * scaling)
+    for y in range(self.height):
+      for x in range(self.width):
+        neighbors = 0
+        for dy in (-1, 0, 1):
+          for dx in (-1, 0, 1):
+            neighbors = (neighbors << 1) | self.GetPixel(data, x + dx, y + dy)
+        for sy in range(scaling):
+          for sx in range(scaling):
+            if ScalePixel(neighbors, sx, sy, scaling):
+              bit = x * scaling + sx
+              out[(y * scaling + sy) * bytes_per_row + bit // 8] |= (
+                  0x80 >> (bit % 8))
+    return out
+
+  def ToCSource(self, out_file, prescaled=(), if_chain=False):
     """Writes this GlyphSet's data into a C source file.
 
     The data written includes:
       - the global dimensions of the glyphs
       - the glyph bitmaps, stored in an array
       - a function to convert code points to the index of the glyph in the
-          bitmap array
+          bitmap array, using a two-level page table, or a chain of range
+          checks with |if_chain|
 
     The C source file outputs static data and methods and is intended to be
     #include'd by a compilation unit.
 
     Args:
       out_file: the file to write the GlyphSet to
+      prescaled: scale factors to also write scaled bitmaps for, as
+          glyphs_scaled_<scaling> arrays
+      if_chain: write the lookup that predates the page table, which the
+          glyph lookup test and benchmark compare against
     """
+    for code_point, width in self.glyph_widths.items():
+      if width != self.width:
+        raise Exception('glyph %s is %s pixels wide, expected %s' %
+                        (code_point, width, self.width))
+
     glyph_properties = {
         'width': self.width,
         'height': self.height,
@@ -74,20 +168,113 @@ class GlyphSet(object):
 
     sorted_glyphs = sorted(self.glyph_map.items())
 
+    if if_chain:
+      self.WriteIfChain(out_file, sorted_glyphs)
+    else:
+      self.WritePageTable(out_file, sorted_glyphs)
+
+    out_file.write('static const uint8_t glyphs[%s][%s] = {\n' %
+                   (len(self.glyph_map), self.glyph_size))
+    for code_point, data in sorted_glyphs:
+      out_file.write('  {')
+      for data_idx in range(self.glyph_size):
+        out_file.write('0x{:02x}, '.format(data[data_idx]))
+      out_file.write('},\n')
+    out_file.write('};\n')
+
+    for scaling in prescaled:
+      self.WriteScaledGlyphs(out_file, sorted_glyphs, scaling)
+    if prescaled:
+      out_file.write('\n#define GLYPH_PRESCALED_MAX %s\n' % max(prescaled))
+
+  def ToPagedFile(self, out_file, cell_width):
+    """Writes this GlyphSet's data as a paged binary fallback font.
+
+    The file starts with a header of eight little endian 32-bit words:
+    magic, version, cell width, glyph height, bytes per row, glyph size,
+    page count and a reserved word. It is followed by the page directory,
+    one file offset per 256 code points, 0 for pages without glyphs. A page
+    holds the width of each of its glyphs in cells (0 if the glyph is
+    missing) followed by the glyph bitmaps. Every glyph is stored two cells
+    wide and left aligned, and pages are aligned so they can be paged in
+    separately.
+
+    Args:
+      out_file: the binary file to write the GlyphSet to
+      cell_width: width in pixels of a single cell, wider glyphs take two
+    """
+    page_size = 1 << PAGED_PAGE_SHIFT
+    bytes_per_row = (2 * cell_width + 7) // 8
+    glyph_size = bytes_per_row * self.height
+    pages = {}
+    for code_point, data in self.glyph_map.items():
+      width = self.glyph_widths[code_point]
+      if width > 2 * cell_width:
+        continue
+      page = pages.setdefault(code_point >> PAGED_PAGE_SHIFT, {})
+      page[code_point & (page_size - 1)] = (width, data)
+
+    page_count = max(pages) + 1
+    header_size = struct.calcsize(PAGED_HEADER_FORMAT) + 4 * page_count
+    page_bytes = page_size + page_size * glyph_size
+    page_stride = (page_bytes + PAGED_ALIGN - 1) // PAGED_ALIGN * PAGED_ALIGN
+    offset = (header_size + PAGED_ALIGN - 1) // PAGED_ALIGN * PAGED_ALIGN
+    directory = [0] * page_count
+    for number in sorted(pages):
+      directory[number] = offset
+      offset += page_stride
+
+    out_file.write(struct.pack(PAGED_HEADER_FORMAT, PAGED_MAGIC,
+                               PAGED_VERSION, cell_width, self.height,
+                               bytes_per_row, glyph_size, page_count, 0))
+    out_file.write(struct.pack('<%sI' % page_count, *directory))
+    for number in sorted(pages):
+      out_file.write(b'\0' * (directory[number] - out_file.tell()))
+      cells = bytearray(page_size)
+      bitmaps = bytearray(page_size * glyph_size)
+      for index, (width, data) in pages[number].items():
+        cells[index] = 1 if width <= cell_width else 2
+        src_bytes_per_row = (self.bits_per_pixel * width + 7) // 8
+        for y in range(self.height):
+          row = data[y * src_bytes_per_row:(y + 1) * src_bytes_per_row]
+          start = index * glyph_size + y * bytes_per_row
+          bitmaps[start:start + len(row)] = bytearray(row)
+      out_file.write(cells)
+      out_file.write(bitmaps)
+
+  def WriteScaledGlyphs(self, out_file, sorted_glyphs, scaling):
+    """Writes the bitmaps of all glyphs scaled by |scaling|."""
+    scaled_size = self.glyph_size * scaling * scaling
+    out_file.write('\nstatic const uint8_t glyphs_scaled_%s[%s][%s] = {\n' %
+                   (scaling, len(sorted_glyphs), scaled_size))
+    for _, data in sorted_glyphs:
+      out_file.write('  {')
+      for byte in self.ScaleGlyph(data, scaling):
+        out_file.write('0x{:02x}, '.format(byte))
+      out_file.write('},\n')
+    out_file.write('};\n')
+
+  def WriteIfChain(self, out_file, sorted_glyphs):
+    """Writes a code point to glyph index lookup as a chain of range checks.
+
+    Every run of consecutive code points gets one check, so lookups take
+    longer the further a code point is from the start of the chain.
+
+    Args:
+      out_file: the file to write the lookup to
+      sorted_glyphs: (code point, data) tuples sorted by code point
+    """
     breaks = []
     last_code_point = None
     for glyph_index, (code_point, _) in enumerate(sorted_glyphs):
       if last_code_point is None or (last_code_point + 1) != code_point:
         breaks.append((code_point, glyph_index))
-
       last_code_point = code_point
-
     breaks.append((None, len(sorted_glyphs)))
 
     out_file.write('static int32_t code_point_to_glyph_index(uint32_t cp)\n{\n')
     for break_idx, (this_break_code_point,
                     this_break_glyph_index) in enumerate(breaks[:-1]):
-      this_break_code_point, this_break_glyph_index = breaks[break_idx]
       next_break_glyph_index = breaks[break_idx + 1][1]
       this_break_range = next_break_glyph_index - this_break_glyph_index
       out_file.write('  if (cp < %s) {\n' %
@@ -106,14 +293,66 @@ class GlyphSet(object):
     out_file.write('  return -1;\n')
     out_file.write('}\n\n')
 
-    out_file.write('static const uint8_t glyphs[%s][%s] = {\n' %
-                   (len(self.glyph_map), self.glyph_size))
-    for code_point, data in sorted_glyphs:
+  def WritePageTable(self, out_file, sorted_glyphs):
+    """Writes a constant time code point to glyph index lookup.
+
+    Code points are split into pages of PAGE_SIZE. The first level maps a
+    page number to one of the pages that contain glyphs, the second level
+    maps the offset inside of that page to the glyph index. Page 0 of the
+    second level has no glyphs and is shared by all empty pages.
+
+    Args:
+      out_file: the file to write the table to
+      sorted_glyphs: (code point, data) tuples sorted by code point
+    """
+    page_shift = 8
+    page_size = 1 << page_shift
+    pages = {}
+    for glyph_index, (code_point, _) in enumerate(sorted_glyphs):
+      page = pages.setdefault(code_point >> page_shift, [-1] * page_size)
+      page[code_point & (page_size - 1)] = glyph_index
+
+    page_count = max(pages) + 1
+    page_numbers = sorted(pages)
+    if len(sorted_glyphs) < 0x8000:
+      index_type = 'int16_t'
+    else:
+      index_type = 'int32_t'
+
+    out_file.write('#define GLYPH_PAGE_SHIFT %s\n\n' % page_shift)
+    if len(page_numbers) < 0x100:
+      page_type = 'uint8_t'
+    else:
+      page_type = 'uint16_t'
+
+    out_file.write('static const %s glyph_page_index[%s] = {' %
+                   (page_type, page_count))
+    for page in range(page_count):
+      if page % 16 == 0:
+        out_file.write('\n  ')
+      if page in pages:
+        out_file.write('%s, ' % (page_numbers.index(page) + 1))
+      else:
+        out_file.write('0, ')
+    out_file.write('\n};\n\n')
+
+    out_file.write('static const %s glyph_pages[%s][%s] = {\n' %
+                   (index_type, len(page_numbers) + 1, page_size))
+    for page in [[-1] * page_size] + [pages[n] for n in page_numbers]:
       out_file.write('  {')
-      for data_idx in range(self.glyph_size):
-        out_file.write('0x{:02x}, '.format(data[data_idx]))
-      out_file.write('},\n')
-    out_file.write('};\n')
+      for entry_idx, entry in enumerate(page):
+        if entry_idx % 16 == 0:
+          out_file.write('\n    ')
+        out_file.write('%s, ' % entry)
+      out_file.write('\n  },\n')
+    out_file.write('};\n\n')
+
+    out_file.write('static int32_t code_point_to_glyph_index(uint32_t cp)\n{\n')
+    out_file.write('  if (cp >= (%s << GLYPH_PAGE_SHIFT))\n' % page_count)
+    out_file.write('    return -1;\n')
+    out_file.write('  return glyph_pages[glyph_page_index[cp >> GLYPH_PAGE_SHIFT]]\n')
+    out_file.write('                    [cp & ((1 << GLYPH_PAGE_SHIFT) - 1)];\n')
+    out_file.write('}\n\n')
 
 
 class BdfState(object):
@@ -134,12 +373,15 @@ class BdfState(object):
         (re.compile(r'FONTBOUNDINGBOX +(\d+) +(\d+) +([+-]?\d+) +([+-]?\d+)$'),
          self.HandleFONTBOUNDINGBOX),
         (re.compile(r'ENCODING +(\d+)$'), self.HandleENCODING),
+        (re.compile(r'BBX +(\d+) +(\d+) +([+-]?\d+) +([+-]?\d+)$'),
+         self.HandleBBX),
         (re.compile(r'BITMAP$'), self.HandleBITMAP),
         (re.compile(r'ENDCHAR$'), self.HandleENDCHAR),
         (re.compile(r'([0-9a-fA-F]{2})+$'), self.HandleDataBITMAP),
     ]
     self.out_glyph_set = None
     self.current_code_point = None
+    self.current_glyph_width = None
     self.current_glyph_data = None
     self.current_glyph_data_index = None
     for line in in_file:
@@ -166,9 +408,25 @@ class BdfState(object):
     """Remembers the code point for a later call to AddGlyph"""
     self.current_code_point = int(match.group(1))
 
+  def HandleBBX(self, match):
+    """Remembers the glyph width, fonts like unifont mix widths.
+
+    Glyphs are expected to be as tall as the font bounding box.
+    """
+    self.current_glyph_width = int(match.group(1))
+    if int(match.group(2)) != self.out_glyph_set.height:
+      raise Exception('glyph %s is %s pixels tall, expected %s' %
+                      (self.current_code_point, match.group(2),
+                       self.out_glyph_set.height))
+
   def HandleBITMAP(self, _match):
     """Construct a blank pre-sized list of bitmap data."""
-    self.current_glyph_data = [0] * self.out_glyph_set.glyph_size
+    glyph_set = self.out_glyph_set
+    if self.current_glyph_width is None:
+      self.current_glyph_width = glyph_set.width
+    bytes_per_row = (glyph_set.bits_per_pixel * self.current_glyph_width +
+                     7) // 8
+    self.current_glyph_data = [0] * (bytes_per_row * glyph_set.height)
     self.current_glyph_data_index = 0
 
   def HandleDataBITMAP(self, match):
@@ -189,18 +447,41 @@ class BdfState(object):
                       (len(self.current_glyph_data),
                        self.current_glyph_data_index))
     self.out_glyph_set.AddGlyph(self.current_code_point,
-                                self.current_glyph_data)
+                                self.current_glyph_data,
+                                self.current_glyph_width)
     self.current_code_point = None
+    self.current_glyph_width = None
     self.current_glyph_data = None
     self.current_glyph_data_index = None
 
 
 def main(args):
+  prescaled = ()
+  paged = False
+  if_chain = False
+  while args and args[0].startswith('--'):
+    if args[0] == '--prescaled':
+      prescaled = (2, 3, 4)
+    elif args[0] == '--if-chain':
+      if_chain = True
+    elif args[0] == '--paged':
+      paged = True
+    else:
+      break
+    args = args[1:]
   if len(args) != 2:
-    print('Usage: %s [INPUT BDF PATH] [OUTPUT C PATH]' % sys.argv[0])
+    print('Usage: %s [--prescaled] [--if-chain] [INPUT BDF PATH] '
+          '[OUTPUT C PATH]\n'
+          '       %s --paged [INPUT BDF PATH] [OUTPUT FONT PATH]' %
+          (sys.argv[0], sys.argv[0]))
     sys.exit(1)
   gs = BdfState(open(args[0], 'r')).out_glyph_set
-  gs.ToCSource(open(args[1], 'w'))
+  if paged:
+    # The narrowest glyph in fonts like unifont is a single cell.
+    gs.ToPagedFile(open(args[1], 'wb'),
+                   min(w for w in gs.glyph_widths.values() if w))
+  else:
+    gs.ToCSource(open(args[1], 'w'), prescaled, if_chain)
 
 
 if __name__ == '__main__':
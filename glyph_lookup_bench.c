@@ -0,0 +1,104 @@
+/*
+ * Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Times the page table lookup in glyphs.h against the range check chain
+ * font_to_c --if-chain writes, over mostly ASCII text and over text heavy in
+ * box drawing and other non-Latin characters.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util.h"
+#include "glyphs.h"
+
+#define code_point_to_glyph_index code_point_to_glyph_index_if_chain
+#define glyphs glyphs_if_chain
+#include "glyphs_if_chain.h"
+#undef code_point_to_glyph_index
+#undef glyphs
+
+#define BENCH_TEXT_LENGTH 4096
+#define BENCH_PASSES 5000
+
+typedef int32_t (*lookup_t)(uint32_t cp);
+
+/* Code points text of each kind is picked from, in [first, last] ranges. */
+static const uint32_t ascii_ranges[][2] = {
+	{ 0x20, 0x7e }, { 0x20, 0x7e }, { 0x20, 0x7e }, { 0x20, 0x7e },
+	{ 0x20, 0x7e }, { 0x20, 0x7e }, { 0x20, 0x7e }, { 0xa0, 0xff },
+};
+
+static const uint32_t unicode_ranges[][2] = {
+	{ 0x2500, 0x257f }, /* box drawing */
+	{ 0x2580, 0x259f }, /* block elements */
+	{ 0x2500, 0x257f },
+	{ 0x0391, 0x03c9 }, /* greek */
+	{ 0x0410, 0x044f }, /* cyrillic */
+	{ 0x2190, 0x21ff }, /* arrows */
+	{ 0x25a0, 0x25ff }, /* geometric shapes */
+	{ 0x20, 0x7e },
+};
+
+static uint32_t text[BENCH_TEXT_LENGTH];
+
+static void fill_text(const uint32_t (*ranges)[2], size_t num_ranges)
+{
+	uint32_t seed = 1;
+
+	for (int i = 0; i < BENCH_TEXT_LENGTH; i++) {
+		const uint32_t* range;
+
+		seed = seed * 1103515245 + 12345;
+		range = ranges[(seed >> 16) % num_ranges];
+		text[i] = range[0] + (seed >> 8) % (range[1] - range[0] + 1);
+	}
+}
+
+static int64_t time_lookup(lookup_t lookup, int64_t* sum)
+{
+	int64_t start = get_monotonic_time_us();
+
+	*sum = 0;
+	for (int pass = 0; pass < BENCH_PASSES; pass++)
+		for (int i = 0; i < BENCH_TEXT_LENGTH; i++)
+			*sum += lookup(text[i]);
+	return get_monotonic_time_us() - start;
+}
+
+static int bench_text(const char* name)
+{
+	int64_t if_chain_sum, page_table_sum;
+	int64_t if_chain_us = time_lookup(code_point_to_glyph_index_if_chain,
+					  &if_chain_sum);
+	int64_t page_table_us = time_lookup(code_point_to_glyph_index,
+					    &page_table_sum);
+	double lookups = (double)BENCH_PASSES * BENCH_TEXT_LENGTH;
+
+	printf("%-8s: if chain %6.2f ns/lookup, page table %6.2f ns/lookup (%.1fx)\n",
+	       name, if_chain_us * 1000.0 / lookups,
+	       page_table_us * 1000.0 / lookups,
+	       page_table_us ? (double)if_chain_us / page_table_us : 0.0);
+
+	if (if_chain_sum != page_table_sum) {
+		fprintf(stderr, "%s: lookups differ\n", name);
+		return 1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	int failures = 0;
+
+	fill_text(ascii_ranges, ARRAY_SIZE(ascii_ranges));
+	failures += bench_text("ascii");
+	fill_text(unicode_ranges, ARRAY_SIZE(unicode_ranges));
+	failures += bench_text("unicode");
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+/*
+ * Checks that the page table lookup in glyphs.h returns the same glyph index
+ * as the range check chain font_to_c --if-chain writes, for every code point
+ * up to past the end of Unicode.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "glyphs.h"
+
+#define code_point_to_glyph_index code_point_to_glyph_index_if_chain
+#define glyphs glyphs_if_chain
+#include "glyphs_if_chain.h"
+#undef code_point_to_glyph_index
+#undef glyphs
+
+#define LAST_CODE_POINT 0x11ffff
+
+int main(void)
+{
+	int failures = 0;
+
+	for (uint32_t cp = 0; cp <= LAST_CODE_POINT; cp++) {
+		int32_t expected = code_point_to_glyph_index_if_chain(cp);
+		int32_t actual = code_point_to_glyph_index(cp);
+
+		if (expected != actual) {
+			fprintf(stderr, "U+%04X: page table %d, if chain %d\n",
+				cp, actual, expected);
+			failures++;
+		}
+	}
+	if (code_point_to_glyph_index(UINT32_MAX) != -1) {
+		fprintf(stderr, "U+%X: page table found a glyph\n", UINT32_MAX);
+		failures++;
+	}
+
+	if (failures) {
+		fprintf(stderr, "%d code points differ\n", failures);
+		return 1;
+	}
+	printf("all code points up to U+%X match\n", LAST_CODE_POINT);
+	return 0;
+}
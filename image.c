@@ -162,43 +162,62 @@ fail:
 	return ret;
 }
 
-int image_show(image_t* image, fb_t* fb)
+void image_get_rect(image_t* image, fb_t* fb, int32_t* x, int32_t* y,
+		    uint32_t* width, uint32_t* height)
 {
-	fb_stepper_t s;
-	int32_t startx, starty;
-	uint32_t w, h;
-
-	if (fb_lock(fb) == NULL)
-		return -1;
-
 	if (image->use_offset && image->use_location) {
 		LOG(WARNING, "offset and location set, using location");
 		image->use_offset = false;
 	}
 
-	w = image->width * image->scale;
-	h = image->height * image->scale;
+	*width = image->width * image->scale;
+	*height = image->height * image->scale;
 
 	if (image->use_location) {
-		startx = image->location_x;
-		starty = image->location_y;
+		*x = image->location_x;
+		*y = image->location_y;
 	} else {
-		startx = (fb_getwidth(fb) - (int32_t)w)/2;
-		starty = (fb_getheight(fb) - (int32_t)h)/2;
+		*x = (fb_getwidth(fb) - (int32_t)*width)/2;
+		*y = (fb_getheight(fb) - (int32_t)*height)/2;
 	}
 
 	if (image->use_offset) {
-		startx += image->offset_x * (int32_t)image->scale;
-		starty += image->offset_y * (int32_t)image->scale;
+		*x += image->offset_x * (int32_t)image->scale;
+		*y += image->offset_y * (int32_t)image->scale;
 	}
+}
 
-	if (!fb_stepper_init(&s, fb, startx, starty, w, h))
+int image_show(image_t* image, fb_t* fb)
+{
+	int32_t startx, starty;
+	uint32_t w, h;
+	uint32_t* line;
+
+	if (fb_lock(fb) == NULL)
+		return -1;
+
+	image_get_rect(image, fb, &startx, &starty, &w, &h);
+
+	if (image->scale == 1) {
+		fb_copy_rect(fb, startx, starty, w, h,
+			     image->layout.as_pixels, image->pitch >> 2);
 		goto done;
+	}
 
-	do {
-		do {
-		} while (fb_stepper_step_x(&s, image->layout.as_pixels[(s.y / image->scale) * (image->pitch >> 2) + (s.x / image->scale)]));
-	} while (fb_stepper_step_y(&s));
+	/* Scale each source row horizontally once and repeat it vertically. */
+	line = (uint32_t*)malloc(w * sizeof(*line));
+	if (!line)
+		goto done;
+
+	for (uint32_t y = 0; y < image->height; y++) {
+		const uint32_t* src_row =
+			&image->layout.as_pixels[y * (image->pitch >> 2)];
+		for (uint32_t x = 0; x < w; x++)
+			line[x] = src_row[x / image->scale];
+		fb_copy_rect(fb, startx, starty + y * image->scale,
+			     w, image->scale, line, 0);
+	}
+	free(line);
 
 done:
 	fb_unlock(fb);
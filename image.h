@@ -26,6 +26,9 @@ void image_set_offset(image_t* image, int32_t offset_x, int32_t offset_y);
 void image_set_location(image_t* image, uint32_t location_x, uint32_t location_y);
 void image_set_scale(image_t* image, uint32_t scale);
 int image_load_image_from_file(image_t* image);
+/* Where image_show() puts the image on |fb|. */
+void image_get_rect(image_t* image, fb_t* fb, int32_t* x, int32_t* y,
+		    uint32_t* width, uint32_t* height);
 int image_show(image_t* image, fb_t* fb);
 void image_release(image_t* image);
 void image_destroy(image_t* image);
@@ -17,11 +17,14 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "blit.h"
 #include "dbus.h"
 #include "dbus_interface.h"
 #include "dev.h"
+#include "font.h"
 #include "input.h"
 #include "main.h"
+#include "pool.h"
 #include "splash.h"
 #include "term.h"
 #include "util.h"
@@ -33,9 +36,12 @@ splash_t* splash;
 
 #define  FLAG_CLEAR                        'c'
 #define  FLAG_DAEMON                       'd'
+#define  FLAG_DOUBLE_BUFFER                'B'
 #define  FLAG_ENABLE_OSC                   'G'
 #define  FLAG_ENABLE_VT1                   '1'
 #define  FLAG_ENABLE_VTS                   'e'
+#define  FLAG_FALLBACK_FONT                'U'
+#define  FLAG_FONT                         'T'
 #define  FLAG_FRAME_INTERVAL               'f'
 #define  FLAG_HELP                         'h'
 #define  FLAG_IMAGE                        'i'
@@ -48,19 +54,25 @@ splash_t* splash;
 #define  FLAG_NO_LOGIN                     'n'
 #define  FLAG_OFFSET                       'O'
 #define  FLAG_PRE_CREATE_VTS               'P'
+#define  FLAG_PREFAULT_FB                  'F'
 #define  FLAG_PRINT_RESOLUTION             'p'
+#define  FLAG_RENDER_THREADS               'R'
 #define  FLAG_SCALE                        'S'
 #define  FLAG_SPLASH_ONLY                  's'
+#define  FLAG_VTE_THREADS                  'V'
 #define  FLAG_WAIT_DROP_MASTER             'W'
 
 static const struct option command_options[] = {
 	{ "clear", required_argument, NULL, FLAG_CLEAR },
 	{ "daemon", no_argument, NULL, FLAG_DAEMON },
 	{ "dev-mode", no_argument, NULL, FLAG_ENABLE_VTS },
+	{ "double-buffer", no_argument, NULL, FLAG_DOUBLE_BUFFER },
 	{ "enable-gfx", no_argument, NULL, FLAG_ENABLE_OSC },
 	{ "enable-osc", no_argument, NULL, FLAG_ENABLE_OSC },
 	{ "enable-vt1", no_argument, NULL, FLAG_ENABLE_VT1 },
 	{ "enable-vts", no_argument, NULL, FLAG_ENABLE_VTS },
+	{ "fallback-font", required_argument, NULL, FLAG_FALLBACK_FONT },
+	{ "font", required_argument, NULL, FLAG_FONT },
 	{ "frame-interval", required_argument, NULL, FLAG_FRAME_INTERVAL },
 	{ "help", no_argument, NULL, FLAG_HELP },
 	{ "image", required_argument, NULL, FLAG_IMAGE },
@@ -74,8 +86,11 @@ static const struct option command_options[] = {
 	{ "offset", required_argument, NULL, FLAG_OFFSET },
 	{ "print-resolution", no_argument, NULL, FLAG_PRINT_RESOLUTION },
 	{ "pre-create-vts", no_argument, NULL, FLAG_PRE_CREATE_VTS },
+	{ "prefault-fb", no_argument, NULL, FLAG_PREFAULT_FB },
+	{ "render-threads", required_argument, NULL, FLAG_RENDER_THREADS },
 	{ "scale", required_argument, NULL, FLAG_SCALE },
 	{ "splash-only", no_argument, NULL, FLAG_SPLASH_ONLY },
+	{ "vte-threads", no_argument, NULL, FLAG_VTE_THREADS },
 	{ "wait-drop-master", no_argument, NULL, FLAG_WAIT_DROP_MASTER },
 	{ NULL, 0, NULL, 0 }
 };
@@ -83,10 +98,13 @@ static const char * const command_help[] = {
 	"Splash screen clear color.",
 	"Daemonize frecon.",
 	"Force dev mode behavior (deprecated, use --enable-vts).",
+	"Render terminals into a back buffer and page flip to it.",
 	"Enable image and box drawing OSC escape codes (deprecated, use --enable-osc).",
 	"Enable OSC escape codes for graphics and input control.",
 	"Enable switching to VT1 and keep a terminal on it.",
 	"Enable additional terminals beyond VT1.",
+	"Paged font file for characters missing from the terminal font.",
+	"PSF2 font file to use for terminals instead of the built-in font.",
 	"Default time (in msecs) between splash animation frames.",
 	"This help screen!",
 	"Image (low res) to use for splash animation.",
@@ -100,8 +118,11 @@ static const char * const command_help[] = {
 	"Absolute location of the splash image on screen (as x,y).",
 	"(Deprecated) Print detected screen resolution and exit.",
 	"Create all VTs immediately instead of on-demand.",
+	"Prefault framebuffer mappings when they are created.",
+	"Threads drawing terminals, 0 (default) uses all CPUs on large screens.",
 	"Default scale for splash screen images.",
 	"Exit immediately after finishing splash animation.",
+	"Read and parse the output of each terminal on its own thread.",
 	"Wait to drop DRM master until the escape code is received.",
 };
 
@@ -174,6 +195,7 @@ int main_process_events(uint32_t usec)
 	fd_set read_set, exception_set;
 	int maxfd = -1;
 	int sstat;
+	int redraw_ms;
 	struct timeval tm;
 	struct timeval* ptm;
 
@@ -185,6 +207,7 @@ int main_process_events(uint32_t usec)
 	dbus_add_fds(&read_set, &exception_set, &maxfd);
 	input_add_fds(&read_set, &exception_set, &maxfd);
 	dev_add_fds(&read_set, &exception_set, &maxfd);
+	drm_add_fds(&read_set, &exception_set, &maxfd);
 
 	for (unsigned i = 0; i < term_num_terminals; i++) {
 		terminal_t* current_term = term_get_terminal(i);
@@ -199,9 +222,18 @@ int main_process_events(uint32_t usec)
 	} else
 		ptm = NULL;
 
+	redraw_ms = term_get_redraw_timeout();
+	if (redraw_ms >= 0 && (!usec || redraw_ms * 1000LL < usec)) {
+		ptm = &tm;
+		tm.tv_sec = redraw_ms / MS_PER_SEC;
+		tm.tv_usec = redraw_ms % MS_PER_SEC * 1000;
+	}
+
 	sstat = select(maxfd + 1, &read_set, NULL, &exception_set, ptm);
-	if (sstat == 0)
+	if (sstat == 0) {
+		term_dispatch_redraw();
 		return 0;
+	}
 
 	dbus_dispatch_io();
 
@@ -209,6 +241,7 @@ int main_process_events(uint32_t usec)
 		return -1;
 
 	dev_dispatch_io(&read_set, &exception_set);
+	drm_dispatch_io(&read_set, &exception_set);
 	input_dispatch_io(&read_set, &exception_set);
 
 	for (unsigned i = 0; i < term_num_terminals; i++) {
@@ -216,6 +249,7 @@ int main_process_events(uint32_t usec)
 		if (term_is_valid(current_term))
 			term_dispatch_io(current_term, &read_set);
 	}
+	term_dispatch_redraw();
 
 	/* Could have changed in input dispatch. */
 	terminal = term_get_current_terminal();
@@ -366,6 +400,10 @@ int main(int argc, char* argv[])
 				command_flags.daemon = true;
 				break;
 
+			case FLAG_DOUBLE_BUFFER:
+				command_flags.double_buffer = true;
+				break;
+
 			case FLAG_ENABLE_OSC:
 				command_flags.enable_osc = true;
 				break;
@@ -378,6 +416,16 @@ int main(int argc, char* argv[])
 				command_flags.enable_vts = true;;
 				break;
 
+			case FLAG_FALLBACK_FONT:
+				if (font_load_fallback(optarg) < 0)
+					LOG(WARNING, "Not using a fallback font.");
+				break;
+
+			case FLAG_FONT:
+				if (font_load(optarg) < 0)
+					LOG(WARNING, "Using the built-in font.");
+				break;
+
 			case FLAG_NO_LOGIN:
 				command_flags.no_login = true;
 				break;
@@ -390,10 +438,22 @@ int main(int argc, char* argv[])
 				command_flags.pre_create_vts = true;
 				break;
 
+			case FLAG_PREFAULT_FB:
+				command_flags.prefault_fb = true;
+				break;
+
+			case FLAG_RENDER_THREADS:
+				term_set_render_threads(strtol(optarg, NULL, 0));
+				break;
+
 			case FLAG_SPLASH_ONLY:
 				command_flags.splash_only = true;
 				break;
 
+			case FLAG_VTE_THREADS:
+				command_flags.vte_threads = true;
+				break;
+
 			case FLAG_WAIT_DROP_MASTER:
 				command_flags.wait_drop_master = true;
 				break;
@@ -435,6 +495,9 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	/* Before render threads can start drawing. */
+	blit_select();
+
 	ret = input_init();
 	if (ret) {
 		LOG(ERROR, "Input init failed.");
@@ -570,6 +633,7 @@ int main(int argc, char* argv[])
 	ret = main_loop();
 
 main_done:
+	pool_close();
 	input_close();
 	dev_close();
 	dbus_destroy();
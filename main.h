@@ -16,12 +16,15 @@ bool set_drm_master_relax(void);
 
 typedef struct {
 	bool    daemon;
+	bool    double_buffer;
 	bool    enable_vts;
 	bool    enable_vt1;
 	bool    splash_only;
 	bool    enable_osc;
 	bool    no_login;
 	bool    pre_create_vts;
+	bool    prefault_fb;
+	bool    vte_threads;
 	bool    wait_drop_master;
 } commandflags_t;
 
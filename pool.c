@@ -0,0 +1,133 @@
+/*
+ * Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+
+#include "pool.h"
+#include "util.h"
+
+/*
+ * Workers sleep on |start| until |generation| moves, then take indexes from
+ * |next| until |count| is reached. The caller of pool_run() takes indexes as
+ * well and waits on |done| for |pending| to drop to zero.
+ */
+static struct {
+	pthread_t threads[POOL_MAX_THREADS - 1];
+	int num_threads;
+	pthread_mutex_t mutex;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	uint64_t generation;
+	bool quit;
+	pool_job_t job;
+	void* arg;
+	int next, count, pending;
+} pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.start = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+/* Called and returns with the mutex held. */
+static void pool_work(void)
+{
+	while (pool.next < pool.count) {
+		int index = pool.next++;
+
+		pthread_mutex_unlock(&pool.mutex);
+		pool.job(pool.arg, index);
+		pthread_mutex_lock(&pool.mutex);
+		if (--pool.pending == 0)
+			pthread_cond_signal(&pool.done);
+	}
+}
+
+static void* pool_thread(void* data)
+{
+	uint64_t generation = 0;
+
+	pthread_mutex_lock(&pool.mutex);
+	for (;;) {
+		while (!pool.quit && pool.generation == generation)
+			pthread_cond_wait(&pool.start, &pool.mutex);
+		if (pool.quit)
+			break;
+		generation = pool.generation;
+		pool_work();
+	}
+	pthread_mutex_unlock(&pool.mutex);
+	return NULL;
+}
+
+int pool_init(int threads)
+{
+	sigset_t all, old;
+	int ret;
+
+	if (pool.num_threads)
+		return pool.num_threads + 1;
+
+	threads = MAX(1, MIN(threads, POOL_MAX_THREADS));
+
+	/* Signals are handled by the main thread. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	while (pool.num_threads < threads - 1) {
+		ret = pthread_create(&pool.threads[pool.num_threads], NULL,
+				     pool_thread, NULL);
+		if (ret) {
+			LOG(WARNING, "Failed to start pool thread: %s.",
+			    strerror(ret));
+			break;
+		}
+		pool.num_threads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return pool.num_threads + 1;
+}
+
+void pool_close(void)
+{
+	pthread_mutex_lock(&pool.mutex);
+	pool.quit = true;
+	pthread_cond_broadcast(&pool.start);
+	pthread_mutex_unlock(&pool.mutex);
+
+	for (int i = 0; i < pool.num_threads; i++)
+		pthread_join(pool.threads[i], NULL);
+	pool.num_threads = 0;
+	pool.quit = false;
+}
+
+int pool_get_threads(void)
+{
+	return pool.num_threads + 1;
+}
+
+void pool_run(pool_job_t job, void* arg, int count)
+{
+	if (!pool.num_threads || count <= 1) {
+		for (int i = 0; i < count; i++)
+			job(arg, i);
+		return;
+	}
+
+	pthread_mutex_lock(&pool.mutex);
+	pool.job = job;
+	pool.arg = arg;
+	pool.next = 0;
+	pool.count = count;
+	pool.pending = count;
+	pool.generation++;
+	pthread_cond_broadcast(&pool.start);
+	pool_work();
+	while (pool.pending)
+		pthread_cond_wait(&pool.done, &pool.mutex);
+	pthread_mutex_unlock(&pool.mutex);
+}
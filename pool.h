@@ -0,0 +1,25 @@
+/*
+ * Copyright 2026 The ChromiumOS Authors
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#define POOL_MAX_THREADS 8
+
+typedef void (*pool_job_t)(void* arg, int index);
+
+/*
+ * Start worker threads so that pool_run() uses |threads| threads in total,
+ * counting the caller. Has to be called after daemonizing, returns the number
+ * of threads the pool ended up with.
+ */
+int pool_init(int threads);
+void pool_close(void);
+int pool_get_threads(void);
+/* Run |job| for every index below |count| on the pool and wait for all. */
+void pool_run(pool_job_t job, void* arg, int count);
+
+#endif
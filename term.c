@@ -7,8 +7,12 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <libtsm.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -21,14 +25,63 @@
 #include "image.h"
 #include "input.h"
 #include "main.h"
+#include "pool.h"
 #include "shl_pty.h"
 #include "term.h"
 #include "util.h"
 
+#define TERM_DEFAULT_REFRESH 60 /* Hz, when the mode does not say */
+#define TERM_STATS_INTERVAL_MS (5 * MS_PER_SEC)
+/* Screens this large are drawn on several threads unless told otherwise. */
+#define TERM_PARALLEL_MIN_PIXELS (2560 * 1440)
+/* Frames drawing fewer cells stay on the main thread. */
+#define TERM_PARALLEL_MIN_OPS 64
+#define TERM_MAX_BANDS (2 * POOL_MAX_THREADS)
+/* Shifts tried per changed row when looking for scrolled rows. */
+#define TERM_SCROLL_CANDIDATES 4
+
+#define TERM_CELL_DRAWN    0x01
+#define TERM_CELL_EMPTY    0x02 /* background only */
+#define TERM_CELL_COMPOSED 0x04 /* |ch| is a hash of the sequence */
+#define TERM_CELL_WIDE     0x08 /* extends over the next cell */
+#define TERM_CELL_COVERED  0x10 /* covered by the wide cell before it */
+
 unsigned int term_num_terminals = 4;
+static int term_render_threads = 0; /* 0 picks by screen size */
+static bool term_pool_started = false;
 static terminal_t* terminals[TERM_MAX_TERMINALS];
 static uint32_t current_terminal = 0;
 
+/* Per screen row, see term_scroll_rows(). */
+typedef struct {
+	uint64_t drawn; /* hash of the row as on screen, 0 if unknown */
+	uint64_t hash; /* hash of the row about to be drawn */
+} term_row_t;
+
+/* Blank cells of a row waiting to be filled as one span. */
+typedef struct {
+	int x, y;
+	uint32_t cells;
+	uint32_t back_color;
+} term_run_t;
+
+/* Cell or blank run queued for the render threads, see term_draw_ops(). */
+typedef struct {
+	const uint8_t* glyph; /* NULL for a blank run */
+	uint16_t x, y;
+	uint16_t cells;
+	uint32_t front_color;
+	uint32_t back_color;
+} term_op_t;
+
+/* What a cell on screen shows, see term_draw_cell(). */
+typedef struct {
+	uint32_t ch;
+	uint32_t front_color;
+	uint32_t back_color;
+	uint32_t flags; /* TERM_CELL_*, 0 if unknown */
+} term_cell_t;
+
 struct term {
 	struct tsm_screen* screen;
 	struct tsm_vte* vte;
@@ -37,8 +90,32 @@ struct term {
 	int pid;
 	tsm_age_t age;
 	int w_in_char, h_in_char;
+	/*
+	 * Shadow of what is on screen, so only cells that look different
+	 * are drawn whatever libtsm's age says. Cells of rows with their bit
+	 * clear in |dirty_rows| are skipped without comparing them. All NULL
+	 * if allocation failed, then drawing relies on age alone.
+	 */
+	term_row_t* rows;
+	term_cell_t* cells;
+	uint32_t* dirty_rows;
+	term_run_t run;
+	/*
+	 * Cells queued while libtsm walks the screen, in row order, when
+	 * |queue_ops| is set for the frame. Room for w_in_char * h_in_char
+	 * ops, allocated on first use.
+	 */
+	term_op_t* ops;
+	uint32_t num_ops;
+	bool queue_ops;
 };
 
+/* OSC sequence parsed on the VTE thread, handled on the main thread. */
+typedef struct term_osc {
+	struct term_osc* next;
+	char string[];
+} term_osc_t;
+
 struct _terminal_t {
 	unsigned vt;
 	bool active;
@@ -46,8 +123,33 @@ struct _terminal_t {
 	uint32_t background;
 	bool background_valid;
 	fb_t* fb;
+	font_t* font;
 	struct term* term;
 	char** exec;
+	/*
+	 * PTY output only marks the terminal for redraw, it is drawn at most
+	 * once per display frame by term_dispatch_redraw().
+	 */
+	bool redraw_pending;
+	/* A key was sent since the last redraw, draw its echo right away. */
+	bool key_pending;
+	int64_t last_redraw_ms;
+	/*
+	 * With --vte-threads PTY output is read and parsed on |vte_thread|,
+	 * holding |lock| meanwhile. The main thread holds |lock| whenever it
+	 * touches the libtsm screen or VTE or the PTY, and learns about new
+	 * output and OSC sequences, which it handles itself, through
+	 * |vte_notify_fd|. |vte_wake_fd| tells the thread to exit.
+	 */
+	pthread_mutex_t lock;
+	pthread_t vte_thread;
+	bool vte_thread_started;
+	int vte_notify_fd;
+	int vte_wake_fd;
+	bool vte_output; /* under |lock| */
+	bool vte_error; /* under |lock|, see term_exception() */
+	term_osc_t* osc_head; /* under |lock| */
+	term_osc_t** osc_tail;
 };
 
 
@@ -62,6 +164,19 @@ static char* interactive_cmd_line[] = {
 static bool in_background = false;
 static bool hotplug_occured = false;
 
+/* Redraws done and redraws skipped because the terminal was hidden. */
+static struct {
+	uint64_t redraws;
+	int64_t redraw_us;
+	uint64_t skipped_redraws;
+	uint64_t scrolled_rows; /* moved instead of drawn */
+	uint64_t cells_drawn;
+	uint64_t cells_skipped;
+	uint64_t cell_frames;
+	uint64_t blank_runs;
+	int64_t last_report_ms;
+} term_stats;
+
 
 static void __attribute__ ((noreturn)) term_run_child(terminal_t* terminal)
 {
@@ -76,21 +191,24 @@ static void __attribute__ ((noreturn)) term_run_child(terminal_t* terminal)
 	}
 }
 
-static int term_draw_cell(struct tsm_screen* screen, uint32_t id,
-			  const uint32_t* ch, size_t len,
-			  unsigned int cwidth, unsigned int posx,
-			  unsigned int posy,
-			  const struct tsm_screen_attr* attr,
-			  tsm_age_t age, void* data)
+static void term_lock(terminal_t* terminal)
+{
+	pthread_mutex_lock(&terminal->lock);
+}
+
+static void term_unlock(terminal_t* terminal)
+{
+	pthread_mutex_unlock(&terminal->lock);
+}
+
+static void term_cell_colors(terminal_t* terminal,
+			     const struct tsm_screen_attr* attr,
+			     uint32_t* front, uint32_t* back)
 {
-	terminal_t* terminal = (terminal_t*)data;
 	uint32_t front_color, back_color;
 	uint8_t br, bb, bg;
 	uint32_t luminance;
 
-	if (age && terminal->term->age && age <= terminal->term->age)
-		return 0;
-
 	if (terminal->background_valid) {
 		br = (terminal->background >> 16) & 0xFF;
 		bg = (terminal->background >> 8) & 0xFF;
@@ -119,34 +237,588 @@ static int term_draw_cell(struct tsm_screen* screen, uint32_t id,
 		back_color = tmp;
 	}
 
-	if (len)
-		font_render(terminal->fb, posx, posy, *ch,
-					front_color, back_color);
+	*front = front_color;
+	*back = back_color;
+}
+
+static void term_free_shadow(struct term* term)
+{
+	free(term->rows);
+	free(term->cells);
+	free(term->dirty_rows);
+	free(term->ops);
+	term->ops = NULL;
+	term->rows = NULL;
+	term->cells = NULL;
+	term->dirty_rows = NULL;
+}
+
+static bool term_row_dirty(struct term* term, int row)
+{
+	return term->dirty_rows[row / 32] & (1u << (row % 32));
+}
+
+static void term_set_row_dirty(struct term* term, int row, bool dirty)
+{
+	if (dirty)
+		term->dirty_rows[row / 32] |= 1u << (row % 32);
 	else
-		font_fillchar(terminal->fb, posx, posy,
-						front_color, back_color);
+		term->dirty_rows[row / 32] &= ~(1u << (row % 32));
+}
+
+/*
+ * Pixels of images and boxes drawn by OSC sequences are not in the shadow
+ * grid, forget what the cells under them show so the next redraw that
+ * touches them paints over them, even if the cells stayed blank.
+ */
+static void term_invalidate_rect(terminal_t* terminal, int32_t x, int32_t y,
+				 uint32_t width, uint32_t height)
+{
+	struct term* term = terminal->term;
+	uint32_t char_width, char_height;
+	int64_t x1, y1, x2, y2;
+
+	if (!term->cells || !terminal->font)
+		return;
+
+	font_get_size(terminal->font, &char_width, &char_height);
+	x1 = MAX(0, (int64_t)x / char_width);
+	y1 = MAX(0, (int64_t)y / char_height);
+	x2 = MIN(term->w_in_char,
+		 ((int64_t)x + width + char_width - 1) / char_width);
+	y2 = MIN(term->h_in_char,
+		 ((int64_t)y + height + char_height - 1) / char_height);
+
+	for (int64_t row = y1; row < y2; row++) {
+		term_cell_t* cells = &term->cells[row * term->w_in_char];
+		/* A wide cell is drawn from its first half. */
+		int64_t start = x1 > 0 && x1 < x2 &&
+			(cells[x1].flags & TERM_CELL_COVERED) ? x1 - 1 : x1;
+
+		if (x2 > start)
+			memset(&cells[start], 0, (x2 - start) * sizeof(*cells));
+		term->rows[row].drawn = 0;
+		term_set_row_dirty(term, row, true);
+	}
+}
+
+static bool term_cell_equal(const term_cell_t* a, const term_cell_t* b)
+{
+	return a->ch == b->ch && a->front_color == b->front_color &&
+	       a->back_color == b->back_color && a->flags == b->flags;
+}
+
+static void term_flush_run(terminal_t* terminal);
+
+static void term_queue_op(terminal_t* terminal, const uint8_t* glyph,
+			  int x, int y, uint32_t cells,
+			  uint32_t front_color, uint32_t back_color)
+{
+	struct term* term = terminal->term;
+	term_op_t* op;
+
+	/* Keep row order, a pending run may still be on the row before. */
+	if (term->run.cells && term->run.y != y)
+		term_flush_run(terminal);
+
+	/* Every op covers cells no other op does, so they always fit. */
+	op = &term->ops[term->num_ops++];
+	op->glyph = glyph;
+	op->x = x;
+	op->y = y;
+	op->cells = cells;
+	op->front_color = front_color;
+	op->back_color = back_color;
+}
+
+static void term_flush_run(terminal_t* terminal)
+{
+	term_run_t run = terminal->term->run;
+
+	if (!run.cells)
+		return;
+
+	terminal->term->run.cells = 0;
+	if (terminal->term->queue_ops)
+		term_queue_op(terminal, NULL, run.x, run.y, run.cells,
+			      0, run.back_color);
+	else
+		font_fillchars(terminal->font, terminal->fb, run.x, run.y,
+			       run.cells, run.back_color);
+	term_stats.blank_runs++;
+}
+
+/*
+ * Blank cells are not filled one by one, consecutive ones on a row with the
+ * same background become a single fill with one span per pixel row. Shell
+ * output leaves most of a wide screen blank, so this is where most cells go.
+ */
+static void term_fill_run(terminal_t* terminal, int x, int y,
+			  uint32_t back_color)
+{
+	term_run_t* run = &terminal->term->run;
+
+	if (run->cells && (run->y != y || run->x + (int)run->cells != x ||
+			   run->back_color != back_color))
+		term_flush_run(terminal);
+
+	if (!run->cells) {
+		run->x = x;
+		run->y = y;
+		run->back_color = back_color;
+	}
+	run->cells++;
+}
+
+static int term_draw_cell(struct tsm_screen* screen, uint32_t id,
+			  const uint32_t* ch, size_t len,
+			  unsigned int cwidth, unsigned int posx,
+			  unsigned int posy,
+			  const struct tsm_screen_attr* attr,
+			  tsm_age_t age, void* data)
+{
+	terminal_t* terminal = (terminal_t*)data;
+	struct term* term = terminal->term;
+	uint32_t front_color, back_color;
+	const uint8_t* glyph;
+	term_cell_t cell;
+
+	if ((term->dirty_rows && !term_row_dirty(term, posy)) ||
+	    (age && term->age && age <= term->age) ||
+	    cwidth == 0 /* covered by the wide character to the left */) {
+		term_stats.cells_skipped++;
+		return 0;
+	}
+
+	if (posx + cwidth > (unsigned int)term->w_in_char)
+		cwidth = term->w_in_char - posx;
+
+	term_cell_colors(terminal, attr, &front_color, &back_color);
+
+	if (term->cells) {
+		term_cell_t* shown = &term->cells[posy * term->w_in_char + posx];
+		uint32_t hash = 2166136261u;
+
+		for (size_t i = 0; len > 1 && i < len; i++)
+			hash = (hash ^ ch[i]) * 16777619u;
+		cell.ch = len > 1 ? hash : len ? ch[0] : 0;
+		cell.front_color = len ? front_color : 0;
+		cell.back_color = back_color;
+		cell.flags = TERM_CELL_DRAWN |
+			     (len ? 0 : TERM_CELL_EMPTY) |
+			     (len > 1 ? TERM_CELL_COMPOSED : 0) |
+			     (cwidth > 1 ? TERM_CELL_WIDE : 0);
+		if (term_cell_equal(shown, &cell)) {
+			term_stats.cells_skipped++;
+			return 0;
+		}
+		shown[0] = cell;
+		if (cwidth > 1) {
+			memset(&shown[1], 0, sizeof(shown[1]));
+			shown[1].flags = TERM_CELL_COVERED;
+		}
+	}
+	term_stats.cells_drawn++;
+
+	/* A space is blank in any font worth using. */
+	if (!len || (len == 1 && ch[0] == ' '))
+		term_fill_run(terminal, posx, posy, back_color);
+	else if (term->queue_ops && len == 1 &&
+		 (glyph = font_get_bitmap(terminal->font, ch[0])))
+		term_queue_op(terminal, glyph, posx, posy, cwidth,
+			      front_color, back_color);
+	else
+		font_render_composed(terminal->font, terminal->fb, posx, posy,
+				     ch, len, cwidth, front_color, back_color);
 
 	return 0;
 }
 
+static int64_t term_frame_interval_ms(terminal_t* terminal)
+{
+	int32_t refresh = fb_getrefresh(terminal->fb);
+
+	if (refresh <= 0)
+		refresh = TERM_DEFAULT_REFRESH;
+	return MS_PER_SEC / refresh;
+}
+
+static int term_hash_cell(struct tsm_screen* screen, uint32_t id,
+			  const uint32_t* ch, size_t len,
+			  unsigned int cwidth, unsigned int posx,
+			  unsigned int posy,
+			  const struct tsm_screen_attr* attr,
+			  tsm_age_t age, void* data)
+{
+	terminal_t* terminal = (terminal_t*)data;
+	uint64_t* hash = &terminal->term->rows[posy].hash;
+	uint32_t front_color, back_color;
+	uint32_t values[4];
+
+	term_cell_colors(terminal, attr, &front_color, &back_color);
+	values[0] = front_color;
+	values[1] = back_color;
+	values[2] = cwidth;
+	values[3] = len;
+	for (size_t i = 0; i < ARRAY_SIZE(values) + len; i++) {
+		uint32_t v = i < ARRAY_SIZE(values) ?
+			values[i] : ch[i - ARRAY_SIZE(values)];
+		*hash = (*hash ^ v) * 0x100000001b3ull;
+	}
+	return 0;
+}
+
+/*
+ * Collect up to TERM_SCROLL_CANDIDATES shifts, nearest first, under which
+ * |row| shows what was drawn in another row.
+ */
+static int term_find_shifts(const term_row_t* rows, int n, int row,
+			    int* shifts, int count)
+{
+	int found = 0;
+
+	for (int d = 1; d < n && found < TERM_SCROLL_CANDIDATES; d++) {
+		int candidates[2] = { d, -d };
+
+		for (int j = 0; j < 2 && found < TERM_SCROLL_CANDIDATES; j++) {
+			int shift = candidates[j];
+			bool known = false;
+
+			if (row + shift < 0 || row + shift >= n ||
+			    rows[row].hash != rows[row + shift].drawn)
+				continue;
+			for (int i = 0; i < count; i++)
+				known |= shifts[i] == shift;
+			if (!known)
+				shifts[count++] = shift;
+			found++;
+		}
+	}
+	return count;
+}
+
+/*
+ * Find rows that are already on screen, possibly after moving the pixels
+ * of a band of rows. Rows are identified by a hash of what is drawn in
+ * them, so a scroll, whether of the whole screen, a scroll region or
+ * through scrollback, shows up as rows matching the rows drawn |shift|
+ * rows below or above. Only shifts that bring back the first or the last
+ * changed row are tried. The band of such rows that saves the most drawing
+ * is moved and only the remaining rows are drawn.
+ *
+ * Without a framebuffer that can move pixels cheaply nothing is hashed and
+ * all rows are left to the cell by cell comparison in term_draw_cell().
+ */
+static void term_scroll_rows(terminal_t* terminal)
+{
+	struct term* term = terminal->term;
+	term_row_t* rows = term->rows;
+	int n = term->h_in_char;
+	int best_gain = 0, best_shift = 0, best_start = 0, best_end = 0;
+	int shifts[2 * TERM_SCROLL_CANDIDATES];
+	int num_shifts = 0, first = -1, last = -1;
+	uint32_t char_width, char_height;
+
+	if (!rows)
+		return;
+
+	if (!fb_can_move_rect(terminal->fb)) {
+		for (int i = 0; i < n; i++) {
+			rows[i].hash = 0; /* unknown once drawn */
+			term_set_row_dirty(term, i, true);
+		}
+		return;
+	}
+
+	for (int i = 0; i < n; i++)
+		rows[i].hash = 0xcbf29ce484222325ull;
+	/* libtsm asks for a full redraw by returning 0 once, pass it on. */
+	if (!tsm_screen_draw(term->screen, term_hash_cell, terminal))
+		term->age = 0;
+	for (int i = 0; i < n; i++) {
+		rows[i].hash |= 1; /* never 0, which is unknown */
+		term_set_row_dirty(term, i, rows[i].hash != rows[i].drawn);
+		if (rows[i].hash != rows[i].drawn) {
+			if (first < 0)
+				first = i;
+			last = i;
+		}
+	}
+	if (first < 0)
+		return;
+
+	num_shifts = term_find_shifts(rows, n, first, shifts, num_shifts);
+	if (last != first)
+		num_shifts = term_find_shifts(rows, n, last, shifts, num_shifts);
+
+	/* Row i now shows what was drawn in row i + shift. */
+	for (int k = 0; k < num_shifts; k++) {
+		int shift = shifts[k];
+		int end = MIN(n, n - shift);
+		int start = -1, gain = 0;
+
+		for (int i = MAX(0, -shift); i <= end; i++) {
+			if (i < end && rows[i].hash == rows[i + shift].drawn) {
+				if (start < 0)
+					start = i;
+				/* Rows already in place gain nothing. */
+				gain += term_row_dirty(term, i);
+				continue;
+			}
+			if (gain > best_gain) {
+				best_gain = gain;
+				best_shift = shift;
+				best_start = start;
+				best_end = i;
+			}
+			start = -1;
+			gain = 0;
+		}
+	}
+
+	if (!best_gain)
+		return;
+
+	font_get_size(terminal->font, &char_width, &char_height);
+	if (!fb_move_rect(terminal->fb, 0, (best_start + best_shift) * char_height,
+			  term->w_in_char * char_width,
+			  (best_end - best_start) * char_height,
+			  -best_shift * (int32_t)char_height))
+		return;
+
+	memmove(&term->cells[best_start * term->w_in_char],
+		&term->cells[(best_start + best_shift) * term->w_in_char],
+		(best_end - best_start) * term->w_in_char * sizeof(*term->cells));
+	for (int i = best_start; i < best_end; i++)
+		term_set_row_dirty(term, i, false);
+	term_stats.scrolled_rows += best_end - best_start;
+}
+
+static bool term_is_visible(terminal_t* terminal)
+{
+	return terminal->active && !in_background;
+}
+
+/*
+ * PTY output only keeps the libtsm state of hidden terminals up to date, what
+ * changed meanwhile is drawn when they are activated. Skips are counted at
+ * the rate frame pacing would have drawn them.
+ */
+static void term_skip_redraw(terminal_t* terminal)
+{
+	int64_t now_ms = get_monotonic_time_ms();
+
+	terminal->redraw_pending = false;
+	terminal->key_pending = false;
+	if (now_ms - terminal->last_redraw_ms >= term_frame_interval_ms(terminal)) {
+		terminal->last_redraw_ms = now_ms;
+		term_stats.skipped_redraws++;
+	}
+}
+
+static void term_report_cell_stats(void)
+{
+	int64_t now_ms = get_monotonic_time_ms();
+
+	term_stats.cell_frames++;
+	if (now_ms - term_stats.last_report_ms < TERM_STATS_INTERVAL_MS)
+		return;
+
+	LOG(DEBUG, "term: per frame %llu cells drawn (%llu blank runs), %llu skipped",
+	    (unsigned long long)(term_stats.cells_drawn / term_stats.cell_frames),
+	    (unsigned long long)(term_stats.blank_runs / term_stats.cell_frames),
+	    (unsigned long long)(term_stats.cells_skipped / term_stats.cell_frames));
+	term_stats.cells_drawn = 0;
+	term_stats.blank_runs = 0;
+	term_stats.cells_skipped = 0;
+	term_stats.cell_frames = 0;
+	term_stats.last_report_ms = now_ms;
+}
+
+/*
+ * Whether to queue the cells of this frame for the render threads, which are
+ * started on first use.
+ */
+static bool term_use_render_threads(terminal_t* terminal)
+{
+	struct term* term = terminal->term;
+	int threads = term_render_threads;
+
+	if (!threads) {
+		if ((int64_t)fb_getwidth(terminal->fb) *
+		    fb_getheight(terminal->fb) < TERM_PARALLEL_MIN_PIXELS)
+			return false;
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads <= 1)
+		return false;
+
+	if (!term_pool_started) {
+		term_pool_started = true;
+		LOG(INFO, "Drawing terminals on %d threads.",
+		    pool_init(threads));
+	}
+	if (pool_get_threads() <= 1)
+		return false;
+
+	if (!term->ops) {
+		term->ops = (term_op_t*)calloc(term->w_in_char * term->h_in_char,
+					       sizeof(*term->ops));
+		if (!term->ops)
+			return false;
+	}
+	return true;
+}
+
+typedef struct {
+	terminal_t* terminal;
+	uint32_t start[TERM_MAX_BANDS + 1]; /* first op of each band */
+} term_bands_t;
+
+static void term_draw_band(void* arg, int band)
+{
+	term_bands_t* bands = (term_bands_t*)arg;
+	terminal_t* terminal = bands->terminal;
+
+	for (uint32_t i = bands->start[band]; i < bands->start[band + 1]; i++) {
+		const term_op_t* op = &terminal->term->ops[i];
+
+		if (!op->glyph) {
+			font_fillchars(terminal->font, terminal->fb,
+				       op->x, op->y, op->cells, op->back_color);
+			continue;
+		}
+		font_draw_bitmap(terminal->font, terminal->fb, op->x, op->y,
+				 op->glyph, op->front_color, op->back_color);
+		/* Glyphs of the main font are a single cell, blank the rest. */
+		if (op->cells > 1)
+			font_fillchars(terminal->font, terminal->fb,
+				       op->x + 1, op->y, op->cells - 1,
+				       op->back_color);
+	}
+}
+
+/*
+ * Draw the queued cells split into bands of rows, on the render threads
+ * when there are enough of them. Bands never share pixels, the damage is
+ * the only shared state and it is added here afterwards, a span per row.
+ */
+static void term_draw_ops(terminal_t* terminal)
+{
+	struct term* term = terminal->term;
+	term_bands_t bands = { .terminal = terminal };
+	uint32_t char_width, char_height;
+	int count = 1;
+	uint32_t i = 0;
+
+	if (term->num_ops >= TERM_PARALLEL_MIN_OPS)
+		count = MIN(2 * pool_get_threads(),
+			    MIN(TERM_MAX_BANDS, term->h_in_char));
+	for (int band = 0; band < count; band++) {
+		int end_row = (band + 1) * term->h_in_char / count;
+
+		bands.start[band] = i;
+		while (i < term->num_ops && term->ops[i].y < end_row)
+			i++;
+	}
+	bands.start[count] = term->num_ops;
+
+	fb_defer_damage(terminal->fb, true);
+	pool_run(term_draw_band, &bands, count);
+	fb_defer_damage(terminal->fb, false);
+
+	font_get_size(terminal->font, &char_width, &char_height);
+	for (i = 0; i < term->num_ops;) {
+		uint32_t y = term->ops[i].y;
+		uint32_t x1 = term->ops[i].x, x2 = x1;
+
+		for (; i < term->num_ops && term->ops[i].y == y; i++) {
+			x1 = MIN(x1, term->ops[i].x);
+			x2 = MAX(x2, (uint32_t)term->ops[i].x + term->ops[i].cells);
+		}
+		fb_damage_rect(terminal->fb, x1 * char_width, y * char_height,
+			       (x2 - x1) * char_width, char_height);
+	}
+	term->num_ops = 0;
+}
+
 static void term_redraw(terminal_t* terminal)
 {
+	int64_t start_us;
+
+	terminal->redraw_pending = false;
+	terminal->key_pending = false;
+	terminal->last_redraw_ms = get_monotonic_time_ms();
 	if (fb_lock(terminal->fb)) {
+		start_us = get_monotonic_time_us();
+		term_lock(terminal);
+		term_scroll_rows(terminal);
+		terminal->term->queue_ops = term_use_render_threads(terminal);
 		terminal->term->age =
 			tsm_screen_draw(terminal->term->screen, term_draw_cell, terminal);
+		term_flush_run(terminal);
+		/* Queued cells are a snapshot, the VTE thread can go on. */
+		term_unlock(terminal);
+		if (terminal->term->queue_ops)
+			term_draw_ops(terminal);
+		terminal->term->queue_ops = false;
+		if (terminal->term->rows)
+			for (int i = 0; i < terminal->term->h_in_char; i++)
+				terminal->term->rows[i].drawn =
+					terminal->term->rows[i].hash;
 		fb_unlock(terminal->fb);
+		term_stats.redraws++;
+		term_stats.redraw_us += get_monotonic_time_us() - start_us;
+		term_report_cell_stats();
 	}
 }
 
+static void term_report_stats(void)
+{
+	if (term_stats.scrolled_rows)
+		LOG(DEBUG, "term: %llu rows moved instead of drawn",
+		    (unsigned long long)term_stats.scrolled_rows);
+
+	if (!term_stats.redraws || !term_stats.skipped_redraws)
+		return;
+
+	LOG(DEBUG, "term: %llu redraws of hidden terminals skipped, about %lld ms of rendering saved",
+	    (unsigned long long)term_stats.skipped_redraws,
+	    (long long)(term_stats.skipped_redraws * term_stats.redraw_us /
+			term_stats.redraws / 1000));
+}
+
 void term_key_event(terminal_t* terminal, uint32_t keysym, int32_t unicode)
 {
 	if (!terminal->input_enable)
 		return;
 
+	term_lock(terminal);
 	if (tsm_vte_handle_keyboard(terminal->term->vte, keysym, 0, 0, unicode))
 		tsm_screen_sb_reset(terminal->term->screen);
+	term_unlock(terminal);
 
 	term_redraw(terminal);
+	terminal->key_pending = true;
+}
+
+/* Pass a wakeup to the main thread, or to the VTE thread to exit. */
+static void term_signal_fd(int fd)
+{
+	uint64_t one = 1;
+
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		LOG(ERROR, "Failed to signal terminal thread: %m.");
+}
+
+static void term_output_done(terminal_t* terminal)
+{
+	if (!term_is_visible(terminal))
+		term_skip_redraw(terminal);
+	else if (terminal->key_pending)
+		term_redraw(terminal);
+	else
+		terminal->redraw_pending = true;
 }
 
 static void term_read_cb(struct shl_pty* pty, char* u8, size_t len, void* data)
@@ -155,7 +827,52 @@ static void term_read_cb(struct shl_pty* pty, char* u8, size_t len, void* data)
 
 	tsm_vte_input(terminal->term->vte, u8, len);
 
-	term_redraw(terminal);
+	if (!terminal->vte_thread_started) {
+		term_output_done(terminal);
+		return;
+	}
+	if (!terminal->vte_output) {
+		terminal->vte_output = true;
+		term_signal_fd(terminal->vte_notify_fd);
+	}
+}
+
+int term_get_redraw_timeout(void)
+{
+	int64_t now_ms = get_monotonic_time_ms();
+	int64_t timeout_ms = -1;
+
+	for (unsigned i = 0; i < term_num_terminals; i++) {
+		terminal_t* terminal = terminals[i];
+		int64_t wait_ms;
+
+		if (!term_is_valid(terminal) || !terminal->redraw_pending)
+			continue;
+		wait_ms = terminal->last_redraw_ms +
+			  term_frame_interval_ms(terminal) - now_ms;
+		if (wait_ms < 0)
+			wait_ms = 0;
+		if (timeout_ms < 0 || wait_ms < timeout_ms)
+			timeout_ms = wait_ms;
+	}
+	return timeout_ms;
+}
+
+void term_dispatch_redraw(void)
+{
+	int64_t now_ms = get_monotonic_time_ms();
+
+	for (unsigned i = 0; i < term_num_terminals; i++) {
+		terminal_t* terminal = terminals[i];
+
+		if (!term_is_valid(terminal) || !terminal->redraw_pending)
+			continue;
+		if (!term_is_visible(terminal))
+			term_skip_redraw(terminal);
+		else if (now_ms - terminal->last_redraw_ms >=
+			 term_frame_interval_ms(terminal))
+			term_redraw(terminal);
+	}
 }
 
 static void term_write_cb(struct tsm_vte* vte, const char* u8, size_t len,
@@ -233,7 +950,6 @@ static void term_esc_draw_box(terminal_t* terminal, char* params)
 	int32_t offx, offy;
 	bool use_offset = false;
 	uint32_t scale = 1;
-	fb_stepper_t s;
 	int32_t startx, starty;
 
 	for (tok = strtok(params, ";"); tok; tok = strtok(NULL, ";")) {
@@ -292,15 +1008,9 @@ static void term_esc_draw_box(terminal_t* terminal, char* params)
 		starty += offy;
 	}
 
-	if (!fb_stepper_init(&s, terminal->fb, startx, starty, w, h))
-		goto done_fb;
-
-	do {
-		do {
-		} while (fb_stepper_step_x(&s, color));
-	} while (fb_stepper_step_y(&s));
+	fb_fill_rect(terminal->fb, startx, starty, w, h, color);
+	term_invalidate_rect(terminal, startx, starty, w, h);
 
-done_fb:
 	fb_unlock(terminal->fb);
 done:
 	;
@@ -349,26 +1059,10 @@ static bool is_xterm_osc(char *osc)
 	return false;
 }
 
-static void term_osc_cb(struct tsm_vte *vte, const uint32_t *osc_string,
-			size_t osc_len, void *data)
+/* Runs on the main thread, frees |entry|. */
+static void term_handle_osc(terminal_t* terminal, term_osc_t* entry)
 {
-	terminal_t* terminal = (terminal_t*)data;
-	size_t i;
-	char *osc;
-
-	for (i = 0; i < osc_len; i++)
-		if (osc_string[i] >= 128)
-			return; /* we only want to deal with ASCII */
-
-	osc = malloc(osc_len + 1);
-	if (!osc) {
-		LOG(WARNING, "Out of memory when processing OSC.\n");
-		return;
-	}
-
-	for (i = 0; i < osc_len; i++)
-		osc[i] = (char)osc_string[i];
-	osc[i] = '\0';
+	char* osc = entry->string;
 
 	if (strncmp(osc, "image:", 6) == 0)
 		term_esc_show_image(terminal, osc + 6);
@@ -385,7 +1079,172 @@ static void term_osc_cb(struct tsm_vte *vte, const uint32_t *osc_string,
 	else
 		LOG(WARNING, "Unknown OSC escape sequence \"%s\", ignoring.", osc);
 
-	free(osc);
+	free(entry);
+}
+
+static void term_osc_cb(struct tsm_vte *vte, const uint32_t *osc_string,
+			size_t osc_len, void *data)
+{
+	terminal_t* terminal = (terminal_t*)data;
+	term_osc_t* entry;
+	size_t i;
+
+	for (i = 0; i < osc_len; i++)
+		if (osc_string[i] >= 128)
+			return; /* we only want to deal with ASCII */
+
+	entry = malloc(sizeof(*entry) + osc_len + 1);
+	if (!entry) {
+		LOG(WARNING, "Out of memory when processing OSC.\n");
+		return;
+	}
+
+	for (i = 0; i < osc_len; i++)
+		entry->string[i] = (char)osc_string[i];
+	entry->string[i] = '\0';
+
+	if (!terminal->vte_thread_started) {
+		term_handle_osc(terminal, entry);
+		return;
+	}
+
+	/* Images, VT switches and DRM master belong to the main thread. */
+	entry->next = NULL;
+	*terminal->osc_tail = entry;
+	terminal->osc_tail = &entry->next;
+	term_signal_fd(terminal->vte_notify_fd);
+}
+
+static void* term_vte_thread(void* data)
+{
+	terminal_t* terminal = (terminal_t*)data;
+	struct pollfd fds[2] = {
+		{ .fd = terminal->term->pty_bridge, .events = POLLIN },
+		{ .fd = terminal->vte_wake_fd, .events = POLLIN },
+	};
+
+	bool output, wake;
+	int ret;
+
+	for (;;) {
+		if (poll(fds, ARRAY_SIZE(fds), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			LOG(ERROR, "VT%u output poll failed: %m.", terminal->vt);
+			term_lock(terminal);
+			terminal->vte_error = true;
+			term_unlock(terminal);
+			term_signal_fd(terminal->vte_notify_fd);
+			break;
+		}
+		if (fds[1].revents)
+			break;
+		if (!fds[0].revents)
+			continue;
+
+		term_lock(terminal);
+		output = terminal->vte_output;
+		ret = shl_pty_bridge_dispatch(terminal->term->pty_bridge, 0);
+		if (ret < 0 || (fds[0].revents & POLLERR))
+			terminal->vte_error = true;
+		/*
+		 * Wake the main loop for events that brought no output as
+		 * well, as it would be without this thread: a shell exiting
+		 * silently only shows up as a hangup on the PTY, and the main
+		 * loop restarts exited shells after handling I/O.
+		 */
+		wake = terminal->vte_error ||
+		       (fds[0].revents & POLLHUP) ||
+		       (!output && !terminal->vte_output);
+		term_unlock(terminal);
+		if (wake)
+			term_signal_fd(terminal->vte_notify_fd);
+	}
+	return NULL;
+}
+
+static int term_start_vte_thread(terminal_t* terminal)
+{
+	sigset_t all, old;
+	int ret;
+
+	terminal->vte_notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	terminal->vte_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (terminal->vte_notify_fd < 0 || terminal->vte_wake_fd < 0) {
+		ret = -errno;
+		goto fail;
+	}
+
+	/* Set before the thread runs, it never changes while it does. */
+	terminal->vte_thread_started = true;
+	/* Signals are handled by the main thread. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = -pthread_create(&terminal->vte_thread, NULL, term_vte_thread,
+			      terminal);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (!ret)
+		return 0;
+
+	terminal->vte_thread_started = false;
+fail:
+	if (terminal->vte_notify_fd >= 0)
+		close(terminal->vte_notify_fd);
+	if (terminal->vte_wake_fd >= 0)
+		close(terminal->vte_wake_fd);
+	terminal->vte_notify_fd = -1;
+	terminal->vte_wake_fd = -1;
+	return ret;
+}
+
+static void term_stop_vte_thread(terminal_t* terminal)
+{
+	term_osc_t* osc;
+
+	if (!terminal->vte_thread_started)
+		return;
+
+	term_signal_fd(terminal->vte_wake_fd);
+	pthread_join(terminal->vte_thread, NULL);
+	terminal->vte_thread_started = false;
+
+	while ((osc = terminal->osc_head)) {
+		terminal->osc_head = osc->next;
+		free(osc);
+	}
+	terminal->osc_tail = &terminal->osc_head;
+	close(terminal->vte_notify_fd);
+	close(terminal->vte_wake_fd);
+	terminal->vte_notify_fd = -1;
+	terminal->vte_wake_fd = -1;
+}
+
+/* Take what the VTE thread left for the main thread. */
+static void term_dispatch_vte(terminal_t* terminal)
+{
+	term_osc_t* osc;
+	uint64_t count;
+	bool output;
+
+	if (read(terminal->vte_notify_fd, &count, sizeof(count)) < 0)
+		return;
+
+	term_lock(terminal);
+	osc = terminal->osc_head;
+	terminal->osc_head = NULL;
+	terminal->osc_tail = &terminal->osc_head;
+	output = terminal->vte_output;
+	terminal->vte_output = false;
+	term_unlock(terminal);
+
+	while (osc) {
+		term_osc_t* next = osc->next;
+
+		term_handle_osc(terminal, osc);
+		osc = next;
+	}
+	if (output)
+		term_output_done(terminal);
 }
 
 #ifdef __clang__
@@ -408,34 +1267,57 @@ static void log_tsm(void* data, const char* file, int line, const char* fn,
 static int term_resize(terminal_t* term, int scaling)
 {
 	uint32_t char_width, char_height;
+	font_t* font;
 	int status;
 
 	if (!scaling)
 		scaling = fb_getscaling(term->fb);
 
-	font_init(scaling);
-	font_get_size(&char_width, &char_height);
+	font = font_init(scaling, fb_getrotation(term->fb));
+	if (!font)
+		return -1;
+	font_get_size(font, &char_width, &char_height);
 
 	term->term->w_in_char = fb_getwidth(term->fb) / char_width;
 	term->term->h_in_char = fb_getheight(term->fb) / char_height;
 
+	term_lock(term);
 	status = tsm_screen_resize(term->term->screen,
 				   term->term->w_in_char, term->term->h_in_char);
+	if (status >= 0)
+		status = shl_pty_resize(term->term->pty, term->term->w_in_char,
+					term->term->h_in_char);
+	term_unlock(term);
 	if (status < 0) {
-		font_free();
+		font_free(font);
 		return -1;
 	}
 
-	status = shl_pty_resize(term->term->pty, term->term->w_in_char,
-				term->term->h_in_char);
-	if (status < 0) {
-		font_free();
-		return -1;
+	term_free_shadow(term->term);
+	term->term->rows = (term_row_t*)calloc(term->term->h_in_char,
+					       sizeof(*term->term->rows));
+	term->term->cells = (term_cell_t*)calloc(
+		term->term->w_in_char * term->term->h_in_char,
+		sizeof(*term->term->cells));
+	term->term->dirty_rows = (uint32_t*)calloc(
+		(term->term->h_in_char + 31) / 32,
+		sizeof(*term->term->dirty_rows));
+	if (!term->term->rows || !term->term->cells ||
+	    !term->term->dirty_rows) {
+		LOG(WARNING, "Failed to allocate terminal shadow grid.");
+		term_free_shadow(term->term);
 	}
 
+	font_free(term->font);
+	term->font = font;
 	return 0;
 }
 
+void term_set_render_threads(int threads)
+{
+	term_render_threads = MAX(0, threads);
+}
+
 void term_set_num_terminals(unsigned new_num)
 {
 	if (new_num < 1)
@@ -463,30 +1345,23 @@ static bool term_is_interactive(unsigned int vt)
  */
 static void term_clear_border(terminal_t* terminal)
 {
-	fb_stepper_t s;
 	uint32_t char_width, char_height;
-	font_get_size(&char_width, &char_height);
+	font_get_size(terminal->font, &char_width, &char_height);
 
 	if (!fb_lock(terminal->fb))
 		return;
 
-	if (fb_stepper_init(&s, terminal->fb,
-			    terminal->term->w_in_char * char_width, 0,
-			    fb_getwidth(terminal->fb) - terminal->term->w_in_char * char_width, terminal->term->h_in_char * char_height)) {
-		do {
-			do {
-			} while (fb_stepper_step_x(&s, terminal->background));
-		} while (fb_stepper_step_y(&s));
-	}
+	fb_fill_rect(terminal->fb,
+		     terminal->term->w_in_char * char_width, 0,
+		     fb_getwidth(terminal->fb) - terminal->term->w_in_char * char_width,
+		     terminal->term->h_in_char * char_height,
+		     terminal->background);
 
-	if (fb_stepper_init(&s, terminal->fb,
-			    0, terminal->term->h_in_char * char_height,
-			    fb_getwidth(terminal->fb), fb_getheight(terminal->fb) - terminal->term->h_in_char * char_height)) {
-		do {
-			do {
-			} while (fb_stepper_step_x(&s, terminal->background));
-		} while (fb_stepper_step_y(&s));
-	}
+	fb_fill_rect(terminal->fb,
+		     0, terminal->term->h_in_char * char_height,
+		     fb_getwidth(terminal->fb),
+		     fb_getheight(terminal->fb) - terminal->term->h_in_char * char_height,
+		     terminal->background);
 
 	fb_unlock(terminal->fb);
 }
@@ -505,6 +1380,7 @@ static void term_show_cursor(terminal_t* terminal)
 terminal_t* term_init(unsigned vt, int pts_fd)
 {
 	const int scrollback_size = 200;
+	pthread_mutexattr_t attr;
 	int status;
 	terminal_t* new_terminal;
 	bool interactive = term_is_interactive(vt);
@@ -513,6 +1389,15 @@ terminal_t* term_init(unsigned vt, int pts_fd)
 	if (!new_terminal)
 		return NULL;
 
+	pthread_mutexattr_init(&attr);
+	/* Entry points that lock also call each other. */
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&new_terminal->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	new_terminal->vte_notify_fd = -1;
+	new_terminal->vte_wake_fd = -1;
+	new_terminal->osc_tail = &new_terminal->osc_head;
+
 	new_terminal->vt = vt;
 	new_terminal->background_valid = false;
 	new_terminal->input_enable = true;
@@ -611,6 +1496,13 @@ terminal_t* term_init(unsigned vt, int pts_fd)
 		term_input_enable(new_terminal, false);
 	}
 
+	if (command_flags.vte_threads) {
+		status = term_start_vte_thread(new_terminal);
+		if (status < 0)
+			LOG(WARNING, "Parsing VT%u output on the main thread: %s.",
+			    vt, strerror(-status));
+	}
+
 	return new_terminal;
 }
 
@@ -619,7 +1511,12 @@ void term_activate(terminal_t* terminal)
 	term_set_current_to(terminal);
 	terminal->active = true;
 	fb_setmode(terminal->fb);
+	/*
+	 * Catch up on output skipped while hidden. The buffer still holds what
+	 * was drawn before, including images, so only changed cells are drawn.
+	 */
 	term_redraw(terminal);
+	term_report_stats();
 }
 
 void term_deactivate(terminal_t* terminal)
@@ -636,6 +1533,9 @@ void term_close(terminal_t* term)
 	if (!term)
 		return;
 
+	/* Before anything the thread uses goes away. */
+	term_stop_vte_thread(term);
+
 	snprintf(path, sizeof(path), FRECON_VT_PATH, term->vt);
 	unlink(path);
 	if (term->vt == term_get_current())
@@ -656,11 +1556,13 @@ void term_close(terminal_t* term)
 			shl_pty_close(term->term->pty);
 			term->term->pty = NULL;
 		}
+		term_free_shadow(term->term);
 		free(term->term);
 		term->term = NULL;
 	}
 
-	font_free();
+	font_free(term->font);
+	pthread_mutex_destroy(&term->lock);
 	free(term);
 }
 
@@ -678,25 +1580,33 @@ bool term_is_child_done(terminal_t* terminal)
 
 void term_page_up(terminal_t* terminal)
 {
+	term_lock(terminal);
 	tsm_screen_sb_page_up(terminal->term->screen, 1);
+	term_unlock(terminal);
 	term_redraw(terminal);
 }
 
 void term_page_down(terminal_t* terminal)
 {
+	term_lock(terminal);
 	tsm_screen_sb_page_down(terminal->term->screen, 1);
+	term_unlock(terminal);
 	term_redraw(terminal);
 }
 
 void term_line_up(terminal_t* terminal)
 {
+	term_lock(terminal);
 	tsm_screen_sb_up(terminal->term->screen, 1);
+	term_unlock(terminal);
 	term_redraw(terminal);
 }
 
 void term_line_down(terminal_t* terminal)
 {
+	term_lock(terminal);
 	tsm_screen_sb_down(terminal->term->screen, 1);
+	term_unlock(terminal);
 	term_redraw(terminal);
 }
 
@@ -715,13 +1625,31 @@ int term_fd(terminal_t* terminal)
 
 void term_dispatch_io(terminal_t* terminal, fd_set* read_set)
 {
-	if (term_is_valid(terminal))
-		if (FD_ISSET(terminal->term->pty_bridge, read_set))
-			shl_pty_bridge_dispatch(terminal->term->pty_bridge, 0);
+	if (!term_is_valid(terminal))
+		return;
+
+	if (terminal->vte_thread_started) {
+		if (FD_ISSET(terminal->vte_notify_fd, read_set))
+			term_dispatch_vte(terminal);
+		return;
+	}
+
+	if (FD_ISSET(terminal->term->pty_bridge, read_set))
+		shl_pty_bridge_dispatch(terminal->term->pty_bridge, 0);
 }
 
 bool term_exception(terminal_t* terminal, fd_set* exception_set)
 {
+	/* The PTY is not in the set, its thread reports errors instead. */
+	if (term_is_valid(terminal) && terminal->vte_thread_started) {
+		bool error;
+
+		term_lock(terminal);
+		error = terminal->vte_error;
+		term_unlock(terminal);
+		return error;
+	}
+
 	if (term_is_valid(terminal)) {
 		if (terminal->term->pty_bridge >= 0) {
 			return FD_ISSET(terminal->term->pty_bridge,
@@ -742,6 +1670,12 @@ bool term_is_active(terminal_t* terminal)
 
 void term_add_fds(terminal_t* terminal, fd_set* read_set, fd_set* exception_set, int* maxfd)
 {
+	if (term_is_valid(terminal) && terminal->vte_thread_started) {
+		*maxfd = MAX(*maxfd, terminal->vte_notify_fd);
+		FD_SET(terminal->vte_notify_fd, read_set);
+		return;
+	}
+
 	if (term_is_valid(terminal)) {
 		if (terminal->term->pty_bridge >= 0) {
 			*maxfd = MAX(*maxfd, terminal->term->pty_bridge);
@@ -764,7 +1698,16 @@ void term_set_background(terminal_t* terminal, uint32_t bg)
 
 int term_show_image(terminal_t* terminal, image_t* image)
 {
-	return image_show(image, terminal->fb);
+	int32_t x, y;
+	uint32_t width, height;
+	int ret;
+
+	ret = image_show(image, terminal->fb);
+	if (!ret) {
+		image_get_rect(image, terminal->fb, &x, &y, &width, &height);
+		term_invalidate_rect(terminal, x, y, width, height);
+	}
+	return ret;
 }
 
 void term_write_message(terminal_t* terminal, char* message)
@@ -943,7 +1886,6 @@ void term_monitor_hotplug(void)
 		if (!terminals[t]->fb)
 			continue;
 		fb_buffer_destroy(terminals[t]->fb);
-		font_free();
 	}
 
 	for (t = 0; t < term_num_terminals; t++) {
@@ -963,7 +1905,6 @@ void term_monitor_hotplug(void)
 void term_redrm(terminal_t* terminal)
 {
 	fb_buffer_destroy(terminal->fb);
-	font_free();
 	fb_buffer_init(terminal->fb);
 	term_resize(terminal, 0);
 	terminal->term->age = 0;
@@ -973,14 +1914,22 @@ void term_redrm(terminal_t* terminal)
 void term_clear(terminal_t* terminal)
 {
 	term_clear_border(terminal);
+	term_lock(terminal);
 	tsm_screen_erase_screen(terminal->term->screen, false);
+	term_unlock(terminal);
 	term_redraw(terminal);
 }
 
 void term_zoom(bool zoom_in)
 {
-	int scaling = font_get_scaling();
-	if (zoom_in && scaling < 4)
+	terminal_t* current = term_get_current_terminal();
+	int scaling;
+
+	if (!current || !current->font)
+		return;
+
+	scaling = font_get_scaling(current->font);
+	if (zoom_in && scaling < FONT_MAX_SCALING)
 		scaling++;
 	else if (!zoom_in && scaling > 1)
 		scaling--;
@@ -988,10 +1937,6 @@ void term_zoom(bool zoom_in)
 		return;
 
 	unsigned int t;
-	for (t = 0; t < term_num_terminals; t++) {
-		if (terminals[t])
-			font_free();
-	}
 	for (t = 0; t < term_num_terminals; t++) {
 		terminal_t* term = terminals[t];
 		if (term) {
@@ -28,6 +28,8 @@ extern unsigned int term_num_terminals;
 typedef struct _terminal_t terminal_t;
 
 void term_set_num_terminals(unsigned new_num);
+/* Threads drawing terminals, 0 uses several on large screens only. */
+void term_set_render_threads(int threads);
 terminal_t* term_init(unsigned vt, int pts_fd);
 void term_close(terminal_t* terminal);
 void term_close(terminal_t* terminal);
@@ -42,6 +44,9 @@ void term_line_down(terminal_t* terminal);
 bool term_is_valid(terminal_t* terminal);
 int term_fd(terminal_t* terminal);
 void term_dispatch_io(terminal_t* terminal, fd_set* read_set);
+/* Milliseconds until a pending redraw is due, -1 if there is none. */
+int term_get_redraw_timeout(void);
+void term_dispatch_redraw(void);
 bool term_exception(terminal_t*, fd_set* exception_set);
 bool term_is_active(terminal_t*);
 void term_activate(terminal_t*);
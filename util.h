@@ -24,6 +24,7 @@
 #define  MS_PER_SEC             (1000LL)
 #define  NS_PER_SEC             (1000LL * 1000LL * 1000LL)
 #define  NS_PER_MS              (NS_PER_SEC / MS_PER_SEC);
+#define  US_PER_SEC             (1000LL * 1000LL)
 
 /* Returns the current CLOCK_MONOTONIC time in milliseconds. */
 static inline int64_t get_monotonic_time_ms() {
@@ -32,6 +33,13 @@ static inline int64_t get_monotonic_time_ms() {
 	return MS_PER_SEC * spec.tv_sec + spec.tv_nsec / NS_PER_MS;
 }
 
+/* Returns the current CLOCK_MONOTONIC time in microseconds. */
+static inline int64_t get_monotonic_time_us() {
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return US_PER_SEC * spec.tv_sec + spec.tv_nsec / (NS_PER_SEC / US_PER_SEC);
+}
+
 #define ERROR                 (LOG_ERR)
 #define WARNING               (LOG_WARNING)
 #define INFO                  (LOG_INFO)